@@ -7,6 +7,7 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "surfcache.h"
 #include "matrix.h"
 #include "math.h"
 
@@ -61,11 +62,23 @@ static const uint16 indexData[] = {
 
 #undef QUAD
 
+/*
+ * The cube texture is refreshed through a temporary surface, whose
+ * size cycles every TEMP_CYCLE_FRAMES frames. Temporaries come from
+ * a surface cache with room for about two idle ones, so we exercise
+ * reuse, defining a new one while the last is still busy, and
+ * trimming the cache when the size changes.
+ */
+
+#define TEMP_CYCLE_FRAMES  256
+#define TEMP_CACHE_BUDGET  (2 * 256 * 256 * sizeof(uint32))
+
 const uint32 numTriangles = sizeof indexData / sizeof indexData[0] / 3;
 uint32 vertexSid, indexSid, textureSid;
 Matrix perspectiveMat;
 FPSCounterState gFPS;
 VMMousePacket lastMouseState;
+SurfaceCache tempCache;
 
 /*
  * render --
@@ -245,6 +258,8 @@ main(void)
    textureSid = SVGA3DUtil_DefineSurface2D(texSize, texSize, SVGA3D_A8R8G8B8);
    checkerSid = defineCheckerboard(texSize, texSize);
 
+   SurfaceCache_Init(&tempCache, TEMP_CACHE_BUDGET);
+
    Matrix_Perspective(perspectiveMat, 45.0f,
                       gSVGA.width / (float)gSVGA.height, 0.1f, 100.0f);
 
@@ -254,13 +269,17 @@ main(void)
          Console_Format(
             "VMware SVGA3D Example:\n"
             "Spinning cube blitter test: \n"
-            "  - SurfaceStretchBlt from back buffer to cube texture\n"
+            "  - SurfaceStretchBlt from back buffer to cube texture,\n"
+            "    via a cached temporary surface of varying size\n"
             "  - SurfaceCopy from cube texture to back buffer\n"
             "  - Checkerboard pattern in bottom left\n"
             "\n"
             "Verify performance and correctness with all blitter implementations.\n"
             "\n"
+            "Temporary surfaces: %d hits, %d misses, %d KB idle\n"
+            "\n"
             "%s",
+            tempCache.hits, tempCache.misses, tempCache.idleBytes / 1024,
             gFPS.text);
 
          SVGA3DText_Update();
@@ -326,22 +345,39 @@ main(void)
 
       SVGA3DUtil_PresentFullscreen();
 
-      /* Stretch blit from back buffer to cube */
+      /*
+       * Stretch blit from back buffer to cube, through a temporary
+       * surface. Smaller temporaries make the cube look blockier.
+       */
       {
+         uint32 tempSize = texSize >> ((gFPS.frame / TEMP_CYCLE_FRAMES) % 3);
+         SVGA3dSurfaceImageId temp = { 0 };
          SVGA3dSurfaceImageId dest = { textureSid };
-         SVGA3dBox boxSrc = { 0 };
+         SVGA3dBox boxScreen = { 0 };
+         SVGA3dBox boxTemp = { 0 };
          SVGA3dBox boxDest = { 0 };
 
-         boxSrc.w = gFullscreen.screen.w;
-         boxSrc.h = gFullscreen.screen.h;
-         boxSrc.d = 1;
+         temp.sid = SurfaceCache_Get(&tempCache, tempSize, tempSize,
+                                     SVGA3D_X8R8G8B8, 0);
+
+         boxScreen.w = gFullscreen.screen.w;
+         boxScreen.h = gFullscreen.screen.h;
+         boxScreen.d = 1;
+
+         boxTemp.w = tempSize;
+         boxTemp.h = tempSize;
+         boxTemp.d = 1;
 
          boxDest.w = texSize;
          boxDest.h = texSize;
          boxDest.d = 1;
 
-         SVGA3D_SurfaceStretchBlt(&gFullscreen.colorImage, &dest, &boxSrc, &boxDest,
+         SVGA3D_SurfaceStretchBlt(&gFullscreen.colorImage, &temp, &boxScreen, &boxTemp,
                                   SVGA3D_STRETCH_BLT_LINEAR);
+         SVGA3D_SurfaceStretchBlt(&temp, &dest, &boxTemp, &boxDest,
+                                  SVGA3D_STRETCH_BLT_POINT);
+
+         SurfaceCache_Put(&tempCache, temp.sid, SVGA_InsertFence());
       }
    }
 
@@ -11,6 +11,7 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "fenceprof.h"
 #include "matrix.h"
 #include "math.h"
 
@@ -167,6 +168,7 @@ main(void)
 {
    SVGA3DUtil_InitFullscreen(CID, 800, 600);
    SVGA3DText_Init();
+   FenceProf_Init();
 
    vertexSid = SVGA3DUtil_LoadCompressedBuffer(vbFile,
                                                (SVGA3D_SURFACE_HINT_VERTEXBUFFER |
@@ -187,22 +189,28 @@ main(void)
          Console_Clear();
          Console_Format("VMware SVGA3D Example:\n"
                         "Bunnies: Drawing 4 copies of the Stanford Bunny,"
-                        " at 65K triangles each.\n\n%s",
+                        " at 65K triangles each.\n\n%s\n",
                         gFPS.text);
+         FenceProf_Dump();
          SVGA3DText_Update();
       }
 
       SVGA3DUtil_ClearFullscreen(CID, SVGA3D_CLEAR_COLOR | SVGA3D_CLEAR_DEPTH,
                                  0x113366, 1.0f, 0);
+      FenceProf_Mark("clear");
 
       setupFrame();
 
       for (i = 0; i < 4; i++) {
          drawMesh(0.8 - i * 1.0f, -1, 3 + i * 1.0f);
       }
+      FenceProf_Mark("draw");
 
       SVGA3DText_Draw();
+      FenceProf_Mark("text");
       SVGA3DUtil_PresentFullscreen();
+      FenceProf_Mark("present");
+      FenceProf_EndFrame();
    }
 
    return 0;
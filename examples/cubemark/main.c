@@ -13,8 +13,10 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "fenceprof.h"
 #include "matrix.h"
 #include "math.h"
+#include "fifomon.h"
 
 typedef uint32 DWORD;
 #include "cube_vs.h"
@@ -71,7 +73,7 @@ static const uint16 indexData[] = {
 #undef QUAD
 
 const uint32 numTriangles = sizeof indexData / sizeof indexData[0] / 3;
-uint32 vertexSid, indexSid;
+StaticArenaBuffer vertexBuf, indexBuf;
 Matrix perspectiveMat;
 FPSCounterState gFPS;
 VMMousePacket lastMouseState;
@@ -166,19 +168,20 @@ render(void)
          {
             decls[0].identity.type = SVGA3D_DECLTYPE_FLOAT3;
             decls[0].identity.usage = SVGA3D_DECLUSAGE_POSITION;
-            decls[0].array.surfaceId = vertexSid;
+            decls[0].array.surfaceId = vertexBuf.sid;
             decls[0].array.stride = sizeof(MyVertex);
-            decls[0].array.offset = offsetof(MyVertex, position);
+            decls[0].array.offset = vertexBuf.offset + offsetof(MyVertex, position);
 
             decls[1].identity.type = SVGA3D_DECLTYPE_D3DCOLOR;
             decls[1].identity.usage = SVGA3D_DECLUSAGE_COLOR;
-            decls[1].array.surfaceId = vertexSid;
+            decls[1].array.surfaceId = vertexBuf.sid;
             decls[1].array.stride = sizeof(MyVertex);
-            decls[1].array.offset = offsetof(MyVertex, color);
+            decls[1].array.offset = vertexBuf.offset + offsetof(MyVertex, color);
 
             ranges[0].primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
             ranges[0].primitiveCount = numTriangles;
-            ranges[0].indexArray.surfaceId = indexSid;
+            ranges[0].indexArray.surfaceId = indexBuf.sid;
+            ranges[0].indexArray.offset = indexBuf.offset;
             ranges[0].indexArray.stride = sizeof(uint16);
             ranges[0].indexWidth = sizeof(uint16);
          }
@@ -202,11 +205,19 @@ render(void)
 int
 main(void)
 {
-   SVGA3DUtil_InitFullscreen(CID, 800, 600);
+   SVGA3DUtil_InitFullscreenBuffered(CID, 800, 600, 2, 2);
    SVGA3DText_Init();
-
-   vertexSid = SVGA3DUtil_DefineStaticBuffer(vertexData, sizeof vertexData);
-   indexSid = SVGA3DUtil_DefineStaticBuffer(indexData, sizeof indexData);
+   FenceProf_Init();
+
+   /*
+    * The vertex and index buffers share one surface and one DMA.
+    */
+   static StaticArena arena;
+   SVGA3DUtil_InitStaticArena(&arena, sizeof vertexData + sizeof indexData);
+   vertexBuf = SVGA3DUtil_StaticArenaAdd(&arena, vertexData, sizeof vertexData, 4);
+   indexBuf = SVGA3DUtil_StaticArenaAdd(&arena, indexData, sizeof indexData,
+                                        sizeof indexData[0]);
+   SVGA3DUtil_StaticArenaUpload(&arena);
 
    SVGA3D_DefineShader(CID, MY_VSHADER_ID, SVGA3D_SHADERTYPE_VS,
                        g_vs20_MyVertexShader, sizeof g_vs20_MyVertexShader);
@@ -219,16 +230,25 @@ main(void)
    while (1) {
       if (SVGA3DUtil_UpdateFPSCounter(&gFPS)) {
          Console_Clear();
-         Console_Format("Cubemark microbenchmark\n\n%s", gFPS.text);
+         Console_Format("Cubemark microbenchmark\n\n%s\n", gFPS.text);
+         FIFOMon_Dump();
+         FIFOMon_Reset();
+         FenceProf_Dump();
          SVGA3DText_Update();
          VMBackdoor_VGAScreenshot();
       }
 
       SVGA3DUtil_ClearFullscreen(CID, SVGA3D_CLEAR_COLOR | SVGA3D_CLEAR_DEPTH,
                                  0x000000, 1.0f, 0);
+      FenceProf_Mark("clear");
       render();
+      FenceProf_Mark("draw");
       SVGA3DText_Draw();
+      FenceProf_Mark("text");
       SVGA3DUtil_PresentFullscreen();
+      FenceProf_Mark("present");
+      FenceProf_EndFrame();
+      FIFOMon_Sample();
    }
 
    return 0;
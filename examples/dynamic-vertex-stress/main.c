@@ -22,6 +22,7 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "gmr.h"
 #include "matrix.h"
 #include "math.h"
 
@@ -215,7 +216,7 @@ void trashBuffer(void)
    SVGA3DUtil_SurfaceDMA2D(vertexSid, &dma->ptr,
                            SVGA3D_WRITE_HOST_VRAM, MESH_NUM_BYTES, 1);
 
-   SVGA3DUtil_AsyncCall((AsyncCallFn) SVGA3DUtil_DMAPoolFreeBuffer, dma);
+   SVGA3DUtil_DMAPoolReleaseBuffer(dma, SVGA_InsertFence());
 }
 
 
@@ -227,22 +228,15 @@ void trashBuffer(void)
 
 void uploadRow(int row, DMAPoolBuffer *dma)
 {
-   SVGA3dCopyBox *boxes;
-   SVGA3dGuestImage guestImage;
-   SVGA3dSurfaceImageId hostImage = { vertexSid };
-
-   guestImage.ptr = dma->ptr;
-   guestImage.pitch = 0;
-
-   SVGA3D_BeginSurfaceDMA(&guestImage, &hostImage, SVGA3D_WRITE_HOST_VRAM, &boxes, 1);
-   {
-      boxes[0].x = MESH_HEIGHT * sizeof(MyVertex) * row;
-      boxes[0].w = MESH_WIDTH * sizeof(MyVertex);
-      boxes[0].srcx = boxes[0].x;
-      boxes[0].h = 1;
-      boxes[0].d = 1;
-   }
-   SVGA_FIFOCommitAll();
+   SVGA3dCopyRect rect = {
+      .x = MESH_HEIGHT * sizeof(MyVertex) * row,
+      .w = MESH_WIDTH * sizeof(MyVertex),
+      .h = 1,
+      .srcx = MESH_HEIGHT * sizeof(MyVertex) * row,
+   };
+
+   SVGA3DUtil_SurfaceDMARect(vertexSid, &dma->ptr, 0, &rect,
+                             SVGA3D_WRITE_HOST_VRAM);
 }
 
 
@@ -304,7 +298,7 @@ render(void)
       drawStrip(row - 1);
    }
 
-   SVGA3DUtil_AsyncCall((AsyncCallFn) SVGA3DUtil_DMAPoolFreeBuffer, dma);
+   SVGA3DUtil_DMAPoolReleaseBuffer(dma, SVGA_InsertFence());
 }
 
 
@@ -318,6 +312,15 @@ int
 main(void)
 {
    SVGA3DUtil_InitFullscreen(CID, 800, 600);
+
+   /*
+    * The DMA pool holds many copies of the 1.5MB mesh. With GMRs,
+    * those come out of guest RAM instead of VRAM.
+    */
+   if (gSVGA.capabilities & SVGA_CAP_GMR) {
+      GMR_Init();
+   }
+
    SVGA3DText_Init();
 
    vertexSid = SVGA3DUtil_DefineSurface2D(MESH_NUM_BYTES, 1, SVGA3D_BUFFER);
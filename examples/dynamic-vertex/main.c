@@ -2,10 +2,16 @@
  * SVGA3D example: Dynamic vertex buffers.
  *
  * This example shows how to efficiently stream vertex data to the
- * GPU, using multiple DMA buffers but a single vertex buffer. We
- * allocate DMA buffers from a pool every time we want to draw a new
- * dynamic mesh, then we asynchronously recycle those buffers after
- * the DMA transfer has completed.
+ * GPU, using a streaming upload ring but a single vertex buffer.
+ * Every time we want to draw a new dynamic mesh, we write it into a
+ * fresh piece of the ring and upload it with the DISCARD hint, so the
+ * host doesn't have to wait for earlier draws to finish with the old
+ * vertices. The ring recycles its space once the DMA has completed.
+ *
+ * The vertices are generated by a separate task, one frame ahead of
+ * the renderer. Whenever the render task blocks waiting on a fence,
+ * the generator task gets the CPU and computes the next frame's
+ * meshes, so vertex generation overlaps with the GPU's work.
  *
  * Copyright (C) 2008-2009 VMware, Inc. Licensed under the MIT
  * License, please see the README.txt. All rights reserved.
@@ -13,6 +19,8 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "uploadring.h"
+#include "task.h"
 #include "matrix.h"
 #include "math.h"
 
@@ -26,17 +34,44 @@
 
 #define MESH_ELEMENT(x, y)  (MESH_WIDTH * (y) + (x))
 
+#define MESH_NUM_BYTES      (MESH_NUM_VERTICES * sizeof(MyVertex))
+#define UPLOAD_RING_SIZE    (4 * 1024 * 1024)
+
+#define NUM_MESHES          3
+#define GEN_STACK_WORDS     4096
+
 typedef struct {
    float position[3];
    float color[3];
 } MyVertex;
 
+typedef struct {
+   float red, green, blue;
+   float phase, offset;
+   float posX, posY, posZ;
+} MeshParams;
+
+const MeshParams meshParams[NUM_MESHES] = {
+   { 1.0, 0.5, 0.5, M_PI, 0,   -1.5, -1, 6 },
+   { 0.5, 1.0, 0.5, 0,    0,    0,    1, 6 },
+   { 0.5, 0.5, 1.0, 0,    1.5,  1.5, -1, 6 },
+};
+
 typedef uint16 IndexType;
-DMAPool vertexDMA;
+UploadRing vertexRing;
 uint32 vertexSid, indexSid;
 Matrix perspectiveMat;
 FPSCounterState gFPS;
 
+/*
+ * Meshes for the next frame. The generator task fills them in and
+ * sets meshesReady, then the render task uploads them and clears it.
+ */
+MyVertex meshes[NUM_MESHES][MESH_NUM_VERTICES];
+volatile Bool meshesReady;
+Task genTask;
+uint32 genStack[GEN_STACK_WORDS];
+
 
 /*
  * setupFrame --
@@ -99,29 +134,23 @@ setupFrame(void)
 
 
 /*
- * updateVertices --
+ * generateMesh --
  *
- *    Calculate new vertices, writing them directly into an available
- *    DMA buffer. Asynchronously begin DMA and recycle the buffer.
+ *    Calculate one mesh's vertices for the given frame.
  */
 
 void
-updateVertices(float red, float green, float blue, float phase, float offset)
+generateMesh(MyVertex *vert, const MeshParams *params, uint32 frame)
 {
-   DMAPoolBuffer *dma;
-   MyVertex *vert;
    int x, y;
-   float t = gFPS.frame * 0.01f + phase;
-
-   dma = SVGA3DUtil_DMAPoolGetBuffer(&vertexDMA);
-   vert = (MyVertex*) dma->buffer;
+   float t = frame * 0.01f + params->phase;
 
    for (y = 0; y < MESH_HEIGHT; y++) {
       for (x = 0; x < MESH_WIDTH; x++) {
 
          float fx = x * (2.0 / MESH_WIDTH) - 1.0;
          float fy = y * (2.0 / MESH_HEIGHT) - 1.0;
-         float fxo = fx + offset;
+         float fxo = fx + params->offset;
          float dist = fxo * fxo + fy * fy;
          float z = sinf(dist * 8.0 + t) / (1 + dist * 10.0);
 
@@ -129,18 +158,79 @@ updateVertices(float red, float green, float blue, float phase, float offset)
          vert->position[1] = fy;
          vert->position[2] = z;
 
-         vert->color[0] = red - z;
-         vert->color[1] = green - z;
-         vert->color[2] = blue - z;
+         vert->color[0] = params->red - z;
+         vert->color[1] = params->green - z;
+         vert->color[2] = params->blue - z;
 
          vert++;
       }
    }
+}
 
-   SVGA3DUtil_SurfaceDMA2D(vertexSid, &dma->ptr, SVGA3D_WRITE_HOST_VRAM,
-                           MESH_NUM_VERTICES * sizeof(MyVertex), 1);
 
-   SVGA3DUtil_AsyncCall((AsyncCallFn) SVGA3DUtil_DMAPoolFreeBuffer, dma);
+/*
+ * meshesConsumed --
+ * meshesAvailable --
+ *
+ *    Task_Wait() callbacks for the handoff between our two tasks.
+ */
+
+Bool
+meshesConsumed(void *arg)
+{
+   return !meshesReady;
+}
+
+Bool
+meshesAvailable(void *arg)
+{
+   return meshesReady;
+}
+
+
+/*
+ * generatorMain --
+ *
+ *    Entry point for the generator task. Each time the render task
+ *    picks up a frame's meshes, start on the next frame's.
+ */
+
+void
+generatorMain(void *arg)
+{
+   uint32 frame = 0;
+   int i;
+
+   while (1) {
+      Task_Wait(meshesConsumed, NULL);
+
+      for (i = 0; i < NUM_MESHES; i++) {
+         generateMesh(meshes[i], &meshParams[i], frame);
+      }
+
+      frame++;
+      meshesReady = TRUE;
+   }
+}
+
+
+/*
+ * uploadMesh --
+ *
+ *    Copy a generated mesh into an available piece of the upload
+ *    ring. Asynchronously begin DMA.
+ */
+
+void
+uploadMesh(const MyVertex *mesh)
+{
+   SVGAGuestPtr ptr;
+   void *buffer = UploadRing_Alloc(&vertexRing, MESH_NUM_BYTES, &ptr);
+
+   memcpy(buffer, mesh, MESH_NUM_BYTES);
+
+   UploadRing_SurfaceDMA(&ptr, vertexSid, 0, MESH_NUM_BYTES, UPLOAD_DISCARD);
+   UploadRing_Mark(&vertexRing);
 }
 
 
@@ -239,16 +329,19 @@ main(void)
    SVGA3DUtil_InitFullscreen(CID, 800, 600);
    SVGA3DText_Init();
 
-   vertexSid = SVGA3DUtil_DefineSurface2D(MESH_NUM_VERTICES * sizeof(MyVertex),
-                                          1, SVGA3D_BUFFER);
+   vertexSid = SVGA3DUtil_DefineSurface2D(MESH_NUM_BYTES, 1, SVGA3D_BUFFER);
    indexSid = createIndexBuffer();
 
-   SVGA3DUtil_AllocDMAPool(&vertexDMA, MESH_NUM_VERTICES * sizeof(MyVertex), 16);
+   UploadRing_Init(&vertexRing, UPLOAD_RING_SIZE);
 
    Matrix_Perspective(perspectiveMat, 45.0f,
                       gSVGA.width / (float)gSVGA.height, 0.1f, 100.0f);
 
+   Task_Create(&genTask, genStack, arraysize(genStack), generatorMain, NULL);
+
    while (1) {
+      int i;
+
       if (SVGA3DUtil_UpdateFPSCounter(&gFPS)) {
          Console_Clear();
          Console_Format("VMware SVGA3D Example:\n"
@@ -262,14 +355,20 @@ main(void)
 
       setupFrame();
 
-      updateVertices(1, 0.5, 0.5, M_PI, 0);
-      drawMesh(-1.5, -1, 6);
+      /*
+       * The generator runs while we're blocked, including while
+       * PresentFullscreen waits for an earlier frame's fence.
+       */
+      Task_Wait(meshesAvailable, NULL);
+
+      for (i = 0; i < NUM_MESHES; i++) {
+         const MeshParams *params = &meshParams[i];
 
-      updateVertices(0.5, 1.0, 0.5, 0, 0);
-      drawMesh(0, 1, 6);
+         uploadMesh(meshes[i]);
+         drawMesh(params->posX, params->posY, params->posZ);
+      }
 
-      updateVertices(0.5, 0.5, 1.0, 0, 1.5);
-      drawMesh(1.5, -1, 6);
+      meshesReady = FALSE;
 
       SVGA3DText_Draw();
       SVGA3DUtil_PresentFullscreen();
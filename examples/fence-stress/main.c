@@ -7,14 +7,35 @@
 
 #include "svga3dutil.h"
 #include "svga3dtext.h"
+#include "task.h"
 
 #define SYNCS_PER_FRAME      1024
 
+
+/*
+ * WakeAvg --
+ *
+ *    Average wakeup latency since 'last', then advance 'last'.
+ */
+
+static uint32
+WakeAvg(volatile SVGAWakeStats *stats, SVGAWakeStats *last)
+{
+   uint32 avg = (uint32)(stats->cycles - last->cycles) /
+                MAX(stats->count - last->count, 1);
+   last->cycles = stats->cycles;
+   last->count = stats->count;
+   return avg;
+}
+
+
 int
 main(void)
 {
    int i, j;
    uint32 fence = 0;
+   uint32 lastRegTotal = 0;
+   static SVGAWakeStats lastHalt, lastPoll;
    static FPSCounterState gFPS;
 
    SVGA3DUtil_InitFullscreen(CID, 640, 480);
@@ -31,8 +52,26 @@ main(void)
                      "%s\n"
                      "\n"
                      "Latest fence: 0x%08x\n"
-                     "   IRQ count: %d\n",
-                     SYNCS_PER_FRAME, gFPS.text, fence, gSVGA.irq.count);
+                     "   IRQ count: %d\n"
+                     "\n"
+                     "Register accesses this frame: %d\n"
+                     "Register writes skipped: %d\n"
+                     "\n"
+                     "IRQ wakeup latency, halting: avg %d max %d cycles\n"
+                     "IRQ wakeup latency, polling: avg %d max %d cycles\n",
+                     SYNCS_PER_FRAME, gFPS.text, fence, gSVGA.irq.count,
+                     gSVGA.regs.total - lastRegTotal, gSVGA.regs.skipped,
+                     WakeAvg(&gSVGA.irq.haltWake, &lastHalt),
+                     gSVGA.irq.haltWake.max,
+                     WakeAvg(&gSVGA.irq.pollWake, &lastPoll),
+                     gSVGA.irq.pollWake.max);
+      lastRegTotal = gSVGA.regs.total;
+
+      /*
+       * Alternate frames between halting and polling, so the polled
+       * latency is a baseline for the halted one.
+       */
+      gTaskPollIdle = !gTaskPollIdle;
       SVGA3DText_Update();
 
       SVGA3DUtil_ClearFullscreen(CID, SVGA3D_CLEAR_COLOR, 0, 1.0f, 0);
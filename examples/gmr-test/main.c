@@ -31,6 +31,7 @@
 #include "svga3dtext.h"
 #include "console_vga.h"
 #include "gmr.h"
+#include "memstats.h"
 #include "math.h"
 #include "mt19937ar.h"
 
@@ -228,6 +229,7 @@ Display_BeginPass(const char *pass)
                   "   Iterations: %d\n"
                   "         Seed: %08x\n"
                   "      Running: %s\n"
+                  "  Descriptors: %d merged into %d, %d pages\n"
                   "\n"
 #ifdef DISABLE_CHECKING
                   "CHECKING DISABLED. This test can't fail.\n",
@@ -235,7 +237,8 @@ Display_BeginPass(const char *pass)
                   "Test is running successfully so far. Will Panic on failure.\n",
 #endif
                   gGMR.maxIds, gGMR.maxDescriptorLen, testIters,
-                  randSeed, testPass);
+                  randSeed, testPass, gGMR.descriptorsIn,
+                  gGMR.descriptorsOut, gGMR.descriptorPages);
 
    VMBackdoor_VGAScreenshot();
    SVGA3DText_Update();
@@ -260,8 +263,8 @@ runTestPass(uint32 testRegionSize,
             SVGA3dCopyBox *boxes,
             uint32 numBoxes)
 {
-   SVGAGuestPtr contig = { 0, 0 };
-   SVGAGuestPtr evenPages = { gGMR.maxIds - 1, 0 };
+   SVGAGuestPtr contig = { GMR_AllocId(), 0 };
+   SVGAGuestPtr evenPages = { GMR_AllocId(), 0 };
    int i;
 
    uint32 contigPages = GMR_DefineContiguous(contig.gmrId, gGMR.maxDescriptorLen * 2);
@@ -302,8 +305,15 @@ runTestPass(uint32 testRegionSize,
 
    TestPattern_Check(PPN_POINTER(contigPages), testRegionSize, 0, __LINE__, i);
 
-   GMR_FreeAll();
-   Heap_Reset();
+   /*
+    * Release both GMRs along with their pages. Don't reset the whole
+    * heap: DMA buffers may live in it. Syncing lets the next pass
+    * reuse the same memory.
+    */
+
+   GMR_Release(contig.gmrId);
+   GMR_Release(evenPages.gmrId);
+   SVGA_SyncToFence(SVGA_InsertFence());
 }
 
 
@@ -548,6 +558,17 @@ runTests(void)
 #undef TEST_FORMAT
 #undef TEST_FORMAT_2D
 
+   /*
+    * Subdivide again, then merge the boxes back together with
+    * SVGA3DUtil_CoalesceBoxes. The coalesced list must copy the same
+    * region.
+    */
+
+   Display_BeginPass("Coalesced copy via 3D A8R8G8B8 surface.");
+   createBoxes(&size3d, boxes, MAX_COPY_BOXES);
+   runTestPass(regionSize*4, &size3d, SVGA3D_A8R8G8B8, boxes,
+               SVGA3DUtil_CoalesceBoxes(boxes, MAX_COPY_BOXES));
+
    /*
     * Test another large 1D copy, split into slightly misaligned chunks.
     */
@@ -571,6 +592,7 @@ main(void)
    SVGA3DText_Init();
    GMR_Init();
    Heap_Reset();
+   MemStats_ReportOnPanic();
 
    tempSurfaceId = SVGA3DUtil_AllocSurfaceID();
    testRegionSize = gGMR.maxDescriptorLen * PAGE_SIZE;
@@ -578,6 +600,11 @@ main(void)
    while (1) {
       runTests();
 
+      /* After one full pass, log how much memory the tests needed. */
+      if (testIters == 0) {
+         MemStats_Export();
+      }
+
       randSeed = genrand_int32();
       testIters++;
    }
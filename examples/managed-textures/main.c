@@ -0,0 +1,348 @@
+/*
+ * SVGA3D example: Spinning cube with managed textures.
+ *
+ * The cube cycles through more mipmapped textures than fit in our
+ * host memory budget, so the residency manager has to evict the
+ * least recently used ones and re-upload them, one mip level at a
+ * time, when they come around again.
+ *
+ * Copyright (C) 2008-2009 VMware, Inc. Licensed under the MIT
+ * License, please see the README.txt. All rights reserved.
+ */
+
+#include "svga3dutil.h"
+#include "svga3dtext.h"
+#include "residency.h"
+#include "matrix.h"
+#include "math.h"
+#include "keyboard.h"
+#include "apm.h"
+
+typedef struct {
+   float position[3];
+   float texcoord[2];
+   float color[3];
+} MyVertex;
+
+static const MyVertex vertexData[] = {
+   { {-1, -1, -1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* -X */
+   { {-1, -1,  1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { {-1,  1, -1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { {-1,  1,  1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+
+   { { 1, -1, -1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* +X */
+   { { 1, -1,  1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { { 1,  1, -1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { { 1,  1,  1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+
+   { {-1, -1, -1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* -Y */
+   { {-1, -1,  1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { { 1, -1, -1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { { 1, -1,  1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+
+   { {-1,  1, -1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* +Y */
+   { {-1,  1,  1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { { 1,  1, -1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { { 1,  1,  1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+
+   { {-1, -1, -1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* -Z */
+   { {-1,  1, -1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { { 1, -1, -1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { { 1,  1, -1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+
+   { {-1, -1,  1}, { 0, 0 }, {0.5, 0.5, 0.5} },  /* +Z */
+   { {-1,  1,  1}, { 0, 1 }, {1.0, 1.0, 1.0} },
+   { { 1, -1,  1}, { 1, 0 }, {0.5, 0.5, 0.5} },
+   { { 1,  1,  1}, { 1, 1 }, {1.0, 1.0, 1.0} },
+};
+
+#define QUAD(a,b,c,d) a, b, d, d, c, a
+
+static const uint16 indexData[] = {
+   QUAD(0,  1,  2,  3),  // -X
+   QUAD(4,  5,  6,  7),  // +X
+   QUAD(8,  9,  10, 11), // -Y
+   QUAD(12, 13, 14, 15), // +Y
+   QUAD(16, 17, 18, 19), // -Z
+   QUAD(20, 21, 22, 23), // +Z
+};
+
+#undef QUAD
+
+/*
+ * Each texture is a checkerboard with a full mip chain. The light
+ * squares identify the texture, and the dark squares get brighter at
+ * each smaller mip level. The budget holds TEX_RESIDENT of them.
+ */
+
+#define NUM_TEXTURES        8
+#define TEX_RESIDENT        3
+#define TEX_SIZE            64
+#define TEX_MIP_LEVELS      7
+#define TEX_CHECK_SIZE      8
+#define FRAMES_PER_TEXTURE  60
+
+static const uint32 textureColors[NUM_TEXTURES] = {
+   0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFFFF00,
+   0xFFFF00FF, 0xFF00FFFF, 0xFFFF8000, 0xFFFFFFFF,
+};
+
+static const uint32 levelColors[TEX_MIP_LEVELS] = {
+   0xFF000000, 0xFF202020, 0xFF404040, 0xFF606060,
+   0xFF808080, 0xFFA0A0A0, 0xFFC0C0C0,
+};
+
+const uint32 numTriangles = sizeof indexData / sizeof indexData[0] / 3;
+uint32 vertexSid, indexSid;
+ManagedSurface textures[NUM_TEXTURES];
+uint32 currentTexture;
+Matrix perspectiveMat;
+FPSCounterState gFPS;
+VMMousePacket lastMouseState;
+
+/*
+ * render --
+ *
+ *   Set up render state, and draw our cube scene from static index
+ *   and vertex buffers, using the current managed texture.
+ *
+ *   This render state only needs to be set each frame because
+ *   SVGA3DText_Draw() changes it.
+ */
+
+void
+render(void)
+{
+   SVGA3dTextureState *ts;
+   SVGA3dRenderState *rs;
+   SVGA3dVertexDecl *decls;
+   SVGA3dPrimitiveRange *ranges;
+   static Matrix view;
+   uint32 textureSid;
+
+   /*
+    * This may re-upload the texture, so it must come before we
+    * reserve FIFO space for the commands that use it.
+    */
+   textureSid = Residency_Use(&textures[currentTexture]);
+
+   Matrix_Copy(view, gIdentityMatrix);
+   Matrix_Scale(view, 0.5, 0.5, 0.5, 1.0);
+
+   if (lastMouseState.buttons & VMMOUSE_LEFT_BUTTON) {
+      Matrix_RotateX(view, lastMouseState.y *  0.0001);
+      Matrix_RotateY(view, lastMouseState.x * -0.0001);
+   } else {
+      Matrix_RotateX(view, 30.0 * M_PI / 180.0);
+      Matrix_RotateY(view, gFPS.frame * 0.01f);
+   }
+
+   Matrix_Translate(view, 0, 0, 3);
+
+   SVGA3D_SetTransform(CID, SVGA3D_TRANSFORM_VIEW, view);
+   SVGA3D_SetTransform(CID, SVGA3D_TRANSFORM_WORLD, gIdentityMatrix);
+   SVGA3D_SetTransform(CID, SVGA3D_TRANSFORM_PROJECTION, perspectiveMat);
+
+   SVGA3D_BeginSetRenderState(CID, &rs, 4);
+   {
+      rs[0].state     = SVGA3D_RS_BLENDENABLE;
+      rs[0].uintValue = FALSE;
+
+      rs[1].state     = SVGA3D_RS_ZENABLE;
+      rs[1].uintValue = TRUE;
+
+      rs[2].state     = SVGA3D_RS_ZWRITEENABLE;
+      rs[2].uintValue = TRUE;
+
+      rs[3].state     = SVGA3D_RS_ZFUNC;
+      rs[3].uintValue = SVGA3D_CMP_LESS;
+   }
+   SVGA_FIFOCommitAll();
+
+   SVGA3D_BeginSetTextureState(CID, &ts, 11);
+   {
+      ts[0].stage = 0;
+      ts[0].name  = SVGA3D_TS_BIND_TEXTURE;
+      ts[0].value = textureSid;
+
+      ts[1].stage = 0;
+      ts[1].name  = SVGA3D_TS_COLOROP;
+      ts[1].value = SVGA3D_TC_MODULATE;
+
+      ts[2].stage = 0;
+      ts[2].name  = SVGA3D_TS_COLORARG1;
+      ts[2].value = SVGA3D_TA_TEXTURE;
+
+      ts[3].stage = 0;
+      ts[3].name  = SVGA3D_TS_COLORARG2;
+      ts[3].value = SVGA3D_TA_DIFFUSE;
+
+      ts[4].stage = 0;
+      ts[4].name  = SVGA3D_TS_ALPHAOP;
+      ts[4].value = SVGA3D_TC_SELECTARG1;
+
+      ts[5].stage = 0;
+      ts[5].name  = SVGA3D_TS_ALPHAARG1;
+      ts[5].value = SVGA3D_TA_DIFFUSE;
+
+      ts[6].stage = 0;
+      ts[6].name  = SVGA3D_TS_MINFILTER;
+      ts[6].value = SVGA3D_TEX_FILTER_LINEAR;
+
+      ts[7].stage = 0;
+      ts[7].name  = SVGA3D_TS_MAGFILTER;
+      ts[7].value = SVGA3D_TEX_FILTER_LINEAR;
+
+      ts[8].stage = 0;
+      ts[8].name  = SVGA3D_TS_MIPFILTER;
+      ts[8].value = SVGA3D_TEX_FILTER_LINEAR;
+
+      ts[9].stage = 0;
+      ts[9].name  = SVGA3D_TS_ADDRESSU;
+      ts[9].value = SVGA3D_TEX_ADDRESS_WRAP;
+
+      ts[10].stage = 0;
+      ts[10].name  = SVGA3D_TS_ADDRESSV;
+      ts[10].value = SVGA3D_TEX_ADDRESS_WRAP;
+   }
+   SVGA_FIFOCommitAll();
+
+   SVGA3D_BeginDrawPrimitives(CID, &decls, 3, &ranges, 1);
+   {
+      decls[0].identity.type = SVGA3D_DECLTYPE_FLOAT3;
+      decls[0].identity.usage = SVGA3D_DECLUSAGE_POSITION;
+      decls[0].array.surfaceId = vertexSid;
+      decls[0].array.stride = sizeof(MyVertex);
+      decls[0].array.offset = offsetof(MyVertex, position);
+
+      decls[1].identity.type = SVGA3D_DECLTYPE_FLOAT2;
+      decls[1].identity.usage = SVGA3D_DECLUSAGE_TEXCOORD;
+      decls[1].array.surfaceId = vertexSid;
+      decls[1].array.stride = sizeof(MyVertex);
+      decls[1].array.offset = offsetof(MyVertex, texcoord);
+
+      decls[2].identity.type = SVGA3D_DECLTYPE_FLOAT3;
+      decls[2].identity.usage = SVGA3D_DECLUSAGE_COLOR;
+      decls[2].array.surfaceId = vertexSid;
+      decls[2].array.stride = sizeof(MyVertex);
+      decls[2].array.offset = offsetof(MyVertex, color);
+
+      ranges[0].primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
+      ranges[0].primitiveCount = numTriangles;
+      ranges[0].indexArray.surfaceId = indexSid;
+      ranges[0].indexArray.stride = sizeof(uint16);
+      ranges[0].indexWidth = sizeof(uint16);
+   }
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ * defineTexture --
+ *
+ *    Fill in the guest copy of a managed checkerboard texture, with
+ *    every mip level packed one after another. Nothing is sent to
+ *    the host until the texture is first used.
+ */
+
+void
+defineTexture(ManagedSurface *surf, uint32 color)
+{
+   uint32 *buffer;
+   uint32 level, size = 0;
+   SVGAGuestPtr gPtr;
+
+   for (level = 0; level < TEX_MIP_LEVELS; level++) {
+      uint32 dim = MAX(1, TEX_SIZE >> level);
+      size += SVGA3DUtil_SurfaceSize2D(dim, dim, SVGA3D_A8R8G8B8);
+   }
+
+   buffer = SVGA3DUtil_AllocDMABuffer(size, &gPtr);
+
+   for (level = 0; level < TEX_MIP_LEVELS; level++) {
+      uint32 dim = MAX(1, TEX_SIZE >> level);
+      uint32 check = MAX(1, TEX_CHECK_SIZE >> level);
+      uint32 i, j;
+
+      for (j = 0; j < dim; j++) {
+         for (i = 0; i < dim; i++) {
+            *buffer = (i / check + j / check) & 1 ? color : levelColors[level];
+            buffer++;
+         }
+      }
+   }
+
+   Residency_DefineSurface(surf, TEX_SIZE, TEX_SIZE, TEX_MIP_LEVELS,
+                           SVGA3D_A8R8G8B8, 0, &gPtr);
+}
+
+
+/*
+ * main --
+ *
+ *    Our example's entry point, invoked directly by the bootloader.
+ */
+
+int
+main(void)
+{
+   uint32 i;
+
+   SVGA3DUtil_InitFullscreen(CID, 800, 600);
+   SVGA3DText_Init();
+   Keyboard_Init();
+   APM_Init();
+
+   vertexSid = SVGA3DUtil_DefineStaticBuffer(vertexData, sizeof vertexData);
+   indexSid = SVGA3DUtil_DefineStaticBuffer(indexData, sizeof indexData);
+
+   for (i = 0; i < NUM_TEXTURES; i++) {
+      defineTexture(&textures[i], textureColors[i]);
+   }
+   Residency_Init(TEX_RESIDENT * textures[0].bytes);
+
+   Matrix_Perspective(perspectiveMat, 45.0f,
+                      gSVGA.width / (float)gSVGA.height, 0.1f, 100.0f);
+
+   while (!Keyboard_IsKeyPressed(KEY_ESCAPE)) {
+
+      if (SVGA3DUtil_UpdateFPSCounter(&gFPS)) {
+         Console_Clear();
+         Console_Format("VMware SVGA3D Example:\n"
+                        "Spinning cube with managed textures.\n"
+                        "%d textures, with room for %d on the host.\n"
+                        "Drag with left mouse button to rotate.\n"
+                        "Hold space to evict every texture.\n"
+                        "Press ESC to exit.\n"
+                        "\n"
+                        "Texture %d: %d KB of %d KB resident\n"
+                        "%d uploads, %d evictions\n"
+                        "\n%s",
+                        NUM_TEXTURES, TEX_RESIDENT, currentTexture,
+                        gResidency.residentBytes / 1024, gResidency.budget / 1024,
+                        gResidency.uploads, gResidency.evictions,
+                        gFPS.text);
+         SVGA3DText_Update();
+         VMBackdoor_VGAScreenshot();
+      }
+
+      while (VMBackdoor_MouseGetPacket(&lastMouseState));
+
+      if (Keyboard_IsKeyPressed(' ')) {
+         for (i = 0; i < NUM_TEXTURES; i++) {
+            Residency_Evict(&textures[i]);
+         }
+      }
+
+      currentTexture = (gFPS.frame / FRAMES_PER_TEXTURE) % NUM_TEXTURES;
+
+      SVGA3DUtil_ClearFullscreen(CID, SVGA3D_CLEAR_COLOR | SVGA3D_CLEAR_DEPTH,
+                                 0x113366, 1.0f, 0);
+      render();
+      SVGA3DText_Draw();
+      SVGA3DUtil_PresentFullscreen();
+   }
+
+   APM_SetPowerState(POWER_OFF);
+   return 0;
+}
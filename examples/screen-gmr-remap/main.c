@@ -3,8 +3,8 @@
  *
  * This test uses GMRs in a rather extreme way- it repeatedly repaints
  * the screen in page-sized (32*32*4 = 4096) chunks, using GMRs which
- * are redefined for each DMA operation. Each in-flight DMA has a
- * separate GMR allocated to it.
+ * are remapped for each DMA operation. Each in-flight DMA has a
+ * separate GMR allocated to it, from a GMRPool.
  *
  * The first page of each GMR contains the data we're actually blitting
  * to the screen. This page comes from a rotating pool of 4096 pages
@@ -19,6 +19,7 @@
 
 #include "svga.h"
 #include "gmr.h"
+#include "gmrpool.h"
 #include "screen.h"
 #include "intr.h"
 #include "math.h"
@@ -107,37 +108,28 @@ main(void)
    fillPages(firstPage, numPages, tileSize);
 
    /*
-    * Allocate a GMR descriptor full of dummy mappings. We'll throw a
-    * handful of these into each GMR, so that the resulting GMRs have
-    * a more realistic size than just a single page.
+    * Every GMR has the same fluff after its first page: a list of
+    * dummy pages, which gives the GMRs a more realistic size than just
+    * a single page.
     */
 
-   static SVGAGuestMemDescriptor dummyPages[128];
+   static PPN dummyPPNs[128];
    int i;
 
-   for (i = 0; i < arraysize(dummyPages); i++) {
-      dummyPages[i].ppn = 1024 + (i & 0xF) * 3;
-      dummyPages[i].numPages = 1;
+   for (i = 0; i < arraysize(dummyPPNs); i++) {
+      dummyPPNs[i] = 1024 + (i & 0xF) * 3;
    }
 
-   PPN dummyDescriptor = GMR_AllocDescriptor(dummyPages, arraysize(dummyPages));
-
    /*
-    * Allocate a single page to use for the GMR descriptor
-    * head. Instead of using GMR_Define(), we'll do this manually so
-    * that we can keep recycling the same single-page descriptor.
+    * The GMR pool owns the GMR IDs and descriptors, and remaps the
+    * first page of a GMR each time we check one out. It waits for
+    * the previous DMA out of a GMR only if it has to (when remapping
+    * through the GMR registers rather than the FIFO). In this example,
+    * we use a pool of 32 GMRs.
     */
 
-   PPN descPage = Heap_AllocPages(1);
-   SVGAGuestMemDescriptor *desc = PPN_POINTER(descPage);
-
-   /*
-    * Each GMR has a fence, so we can wait to re-use it until after
-    * the DMA has expired. In this example, we use the first 32 GMRs.
-    */
-
-   uint32 gmrFences[32] = { 0 };
-   uint32 gmrIndex = 5;
+   static GMRPool pool;
+   GMRPool_Init(&pool, 32, 1, dummyPPNs, arraysize(dummyPPNs));
 
    /*
     * Keep looping over the whole screen, tile by tile.
@@ -149,24 +141,11 @@ main(void)
          for (x = 0; x < myScreen.size.width; x += tileSize) {
 
             /*
-             * Wait until we're done with the old GMR.
+             * Get a GMR whose first page is the next sysmem page in
+             * our pool.
              */
 
-            SVGA_SyncToFence(gmrFences[gmrIndex]);
-
-            /*
-             * Define the new GMR, point it to the next sysmem page in
-             * our pool.  The first page in this GMR will be our
-             * filled page, the rest will be dummy pages.
-             */
-
-            desc[0].ppn = currentPage;
-            desc[0].numPages = 1;
-            desc[1].ppn = dummyDescriptor;
-            desc[1].numPages = 0;
-
-            SVGA_WriteReg(SVGA_REG_GMR_ID, gmrIndex);
-            SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, descPage);
+            uint32 gmrId = GMRPool_Get(&pool, &currentPage);
 
             currentPage++;
             if (currentPage == lastPage) {
@@ -174,12 +153,12 @@ main(void)
             }
 
             /*
-             * Do a blit from this GMR to the screen, and set a fence so that
-             * we can wait to recycle the GMR until after this DMA completes.
+             * Do a blit from this GMR to the screen, and give the GMR back
+             * with a fence so it isn't recycled until this DMA completes.
              */
 
             SVGAGuestPtr gPtr = {
-               .gmrId = gmrIndex,
+               .gmrId = gmrId,
                .offset = 0,
             };
             Screen_DefineGMRFB(gPtr, tileBytesPerLine, tileFormat);
@@ -188,12 +167,7 @@ main(void)
             SVGASignedRect blitDest = { x, y, x+tileSize, y+tileSize };
 
             Screen_BlitFromGMRFB(&blitOrigin, &blitDest, myScreen.id);
-            gmrFences[gmrIndex] = SVGA_InsertFence();
-
-            /*
-             * Next GMR..
-             */
-            gmrIndex = (gmrIndex + 1) % arraysize(gmrFences);
+            GMRPool_Put(&pool, gmrId, SVGA_InsertFence());
          }
       }
    }
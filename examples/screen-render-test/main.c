@@ -555,7 +555,7 @@ doBlits()
    const int offset = 12345;
    const int numPages = (offset + numBytes + PAGE_MASK) / PAGE_SIZE;
 
-   const int gmrId = 2;
+   const uint32 gmrId = GMR_AllocId();
    PPN firstPage = GMR_DefineContiguous(gmrId, numPages);
 
    int i;
@@ -598,6 +598,8 @@ doBlits()
       Console_MoveTo(dstRect.left + blits[i].labelx, dstRect.top + blits[i].labely);
       Console_WriteString(blits[i].label);
    }
+
+   GMR_Release(gmrId);
 }
 
 
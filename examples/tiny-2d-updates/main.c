@@ -12,6 +12,17 @@
 
 #include "svga.h"
 #include "intr.h"
+#include "throttle.h"
+
+/*
+ * Keep at most about one 60Hz frame's worth of updates queued. The
+ * FIFO can hold far more than that, and everything queued behind it
+ * would wait.
+ */
+
+#define LATENCY_BUDGET_US  16000
+
+static Throttle throttle;
 
 /*
  * paintScreen --
@@ -50,10 +61,14 @@ paintScreen(uint32 color)
       uint32 *row = fb;
       fb = (uint32*) (gSVGA.pitch + (uint8*)fb);
 
+      Throttle_Wait(&throttle);
+
       for (x = 0; x < gSVGA.width; x++) {
          *(row++) = color;
          SVGA_Update(x, y, 1, 1);
       }
+
+      Throttle_Mark(&throttle);
    }
 }
 
@@ -70,6 +85,7 @@ main(void)
    Intr_SetFaultHandlers(SVGA_DefaultFaultHandler);
    SVGA_Init();
    SVGA_SetMode(640, 480, 32);
+   Throttle_Init(&throttle, LATENCY_BUDGET_US, 0);
 
    while (1) {
       /* Alternate colors on each frame */
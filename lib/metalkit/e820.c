@@ -0,0 +1,126 @@
+/* -*- Mode: C; c-basic-offset: 3 -*-
+ *
+ * e820.c - Physical memory map from the BIOS (INT 15h, E820h).
+ *
+ * This file is part of Metalkit, a simple collection of modules for
+ * writing software that runs on the bare metal. Get the latest code
+ * at http://svn.navi.cx/misc/trunk/metalkit/
+ *
+ * Copyright (c) 2009 Micah Dowty
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "e820.h"
+#include "bios.h"
+
+E820State gE820;
+
+
+/*
+ * E820_Init --
+ *
+ *    Ask the BIOS for the physical memory map, and store it in gE820.
+ *    Each call to the BIOS returns one address range, and a
+ *    continuation value for the next call. The last range returns a
+ *    continuation of zero.
+ *
+ *    Returns FALSE if the BIOS doesn't support E820. In that case,
+ *    gE820 will have no entries.
+ */
+
+fastcall Bool
+E820_Init()
+{
+   E820State *self = &gE820;
+   E820Entry *tempEntry = (void*) BIOS_SHARED->userdata;
+   uint32 continuation = 0;
+   Regs reg = {};
+
+   self->numEntries = 0;
+
+   do {
+      reg.eax = 0xE820;
+      reg.edx = SIGNATURE_SMAP;
+      reg.ebx = continuation;
+      reg.ecx = sizeof *tempEntry;
+      reg.es = 0;
+      reg.di = PTR_32_TO_NEAR(tempEntry, 0);
+      BIOS_Call(0x15, &reg);
+
+      if (reg.cf != 0 || reg.eax != SIGNATURE_SMAP) {
+         break;
+      }
+
+      if (reg.ecx >= 20 && tempEntry->length) {
+         memcpy(&self->entries[self->numEntries++], tempEntry, sizeof *tempEntry);
+      }
+      continuation = reg.ebx;
+
+   } while (continuation && self->numEntries < E820_MAX_ENTRIES);
+
+   return self->numEntries != 0;
+}
+
+
+/*
+ * E820_GetRAMLimit --
+ *
+ *    Find the usable RAM which contains 'addr', and return the end of
+ *    it. Adjacent or overlapping RAM ranges are merged, since the BIOS
+ *    may report one region in several pieces. We only deal in 32-bit
+ *    addresses, so the limit is capped just below 4GB.
+ *
+ *    Returns 0 if 'addr' isn't in usable RAM, or if we have no map.
+ */
+
+fastcall uint32
+E820_GetRAMLimit(uint32 addr)
+{
+   E820State *self = &gE820;
+   uint64 limit = addr;
+   Bool found = FALSE;
+   Bool grew;
+   int i;
+
+   do {
+      grew = FALSE;
+      for (i = 0; i < self->numEntries; i++) {
+         E820Entry *entry = &self->entries[i];
+         uint64 end = entry->base + entry->length;
+
+         if (entry->type == E820_TYPE_RAM &&
+             entry->base <= limit && limit < end) {
+            limit = end;
+            found = grew = TRUE;
+         }
+      }
+   } while (grew);
+
+   if (!found) {
+      return 0;
+   }
+   if (limit > 0xFFFFF000) {
+      limit = 0xFFFFF000;
+   }
+   return (uint32) limit;
+}
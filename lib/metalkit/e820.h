@@ -0,0 +1,63 @@
+/* -*- Mode: C; c-basic-offset: 3 -*-
+ *
+ * e820.h - Physical memory map from the BIOS (INT 15h, E820h).
+ *
+ * This file is part of Metalkit, a simple collection of modules for
+ * writing software that runs on the bare metal. Get the latest code
+ * at http://svn.navi.cx/misc/trunk/metalkit/
+ *
+ * Copyright (c) 2009 Micah Dowty
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __E820_H__
+#define __E820_H__
+
+#include "types.h"
+
+#define SIGNATURE_SMAP     0x534D4150    // "SMAP"
+#define E820_MAX_ENTRIES   32
+
+/* Address range types */
+#define E820_TYPE_RAM        1
+#define E820_TYPE_RESERVED   2
+#define E820_TYPE_ACPI       3
+#define E820_TYPE_NVS        4
+
+typedef struct {
+   uint64       base;
+   uint64       length;
+   uint32       type;
+} PACKED E820Entry;
+
+typedef struct {
+   uint32       numEntries;        // Zero if the BIOS doesn't support E820
+   E820Entry    entries[E820_MAX_ENTRIES];
+} E820State;
+
+extern E820State gE820;
+
+fastcall Bool E820_Init();
+fastcall uint32 E820_GetRAMLimit(uint32 addr);
+
+#endif /* __E820_H__ */
@@ -173,7 +173,7 @@ typedef struct IntrContext {
 
 #define Intr_GetContext(arg)  ((IntrContext*) &(&arg)[1])
 
-uint32 Intr_SaveContext(IntrContext *ctx);
+uint32 Intr_SaveContext(IntrContext *ctx) __attribute__ ((returns_twice));
 void Intr_RestoreContext(IntrContext *ctx);
 fastcall void Intr_InitContext(IntrContext *ctx, uint32 *stack, IntrContextFn main);
 
@@ -0,0 +1,270 @@
+/* -*- Mode: C; c-basic-offset: 3 -*-
+ *
+ * task.c - Cooperative multitasking.
+ *
+ * This file is part of Metalkit, a simple collection of modules for
+ * writing software that runs on the bare metal. Get the latest code
+ * at http://svn.navi.cx/misc/trunk/metalkit/
+ *
+ * Copyright (c) 2008-2009 Micah Dowty
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "task.h"
+#include "console.h"
+
+static Task gTaskMain = { .next = &gTaskMain };
+Task *gTaskCurrent = &gTaskMain;
+
+/*
+ * If set, spin instead of halting when every task is blocked. This
+ * is only useful as a baseline when measuring wakeup latency.
+ */
+Bool gTaskPollIdle;
+
+
+/*
+ * TaskTrampoline --
+ *
+ *    Entry point for all new tasks. Calls the task's main function,
+ *    and exits the task if it returns.
+ */
+
+static void
+TaskTrampoline(void)
+{
+   Task *task = gTaskCurrent;
+   task->main(task->arg);
+   Task_Exit();
+}
+
+
+/*
+ * Task_Create --
+ *
+ *    Create a new task, which will run main(arg) on its own stack.
+ *    The task is inserted into the run queue just after the current
+ *    task, so it runs the next time we yield.
+ *
+ *    The Task and its stack must stay allocated until the task
+ *    exits.
+ */
+
+fastcall void
+Task_Create(Task *task, uint32 *stack, uint32 stackWords, TaskFn main, void *arg)
+{
+   /*
+    * Intr_RestoreContext builds a small frame just above and below
+    * the context's stack pointer before jumping to it, and the
+    * task's function finds its return address above that. Leave
+    * room for both at the top of the stack. If the trampoline ever
+    * did return, it would land in Task_Exit.
+    */
+
+   stack[stackWords - 1] = (uint32) Task_Exit;
+   Intr_InitContext(&task->context, &stack[stackWords - 4], TaskTrampoline);
+
+   task->main = main;
+   task->arg = arg;
+   task->next = gTaskCurrent->next;
+   gTaskCurrent->next = task;
+}
+
+
+/*
+ * TaskFindRunnable --
+ *
+ *    Look for a task that can run, starting just after the current
+ *    task and ending with the current task itself. Returns NULL if
+ *    every task is blocked.
+ */
+
+static Task *
+TaskFindRunnable(void)
+{
+   Task *task = gTaskCurrent;
+
+   do {
+      task = task->next;
+      if (!task->wait || task->wait(task->waitArg)) {
+         return task;
+      }
+   } while (task != gTaskCurrent);
+
+   return NULL;
+}
+
+
+/*
+ * TaskSwitch --
+ *
+ *    Switch to the next runnable task. If nothing can run, idle
+ *    until an interrupt makes some task runnable.
+ *
+ *    Like "sti; hlt" elsewhere, we check for a runnable task with
+ *    interrupts disabled before halting, so an interrupt that
+ *    arrives after the check still wakes us.
+ *
+ *    Returns TRUE if another task ran, or FALSE if the current task
+ *    was the one we picked. Must be called with interrupts enabled.
+ */
+
+static Bool
+TaskSwitch(void)
+{
+   Task *prev = gTaskCurrent;
+   Task *next;
+
+   while (1) {
+      next = TaskFindRunnable();
+      if (next) {
+         break;
+      }
+
+      if (gTaskPollIdle) {
+         asm volatile ("pause");
+         continue;
+      }
+
+      Intr_Disable();
+      next = TaskFindRunnable();
+      if (next) {
+         Intr_Enable();
+         break;
+      }
+      asm volatile ("sti; hlt" ::: "memory");
+   }
+
+   if (next == prev) {
+      return FALSE;
+   }
+
+   /*
+    * Intr_SaveContext returns zero when we save, and the saved
+    * %eax when we're resumed.
+    */
+
+   if (Intr_SaveContext(&prev->context) == 0) {
+      prev->context.eax = 1;
+      gTaskCurrent = next;
+      Intr_RestoreContext(&next->context);
+   }
+
+   return TRUE;
+}
+
+
+/*
+ * Task_Yield --
+ *
+ *    Switch to the next runnable task. Returns when every other
+ *    runnable task has had a chance to run.
+ *
+ *    Returns TRUE if another task ran, or FALSE if no other task
+ *    was runnable and we returned immediately.
+ */
+
+fastcall Bool
+Task_Yield(void)
+{
+   return TaskSwitch();
+}
+
+
+/*
+ * Task_Wait --
+ *
+ *    Block the current task until wait(arg) returns TRUE, running
+ *    other tasks in the meantime. The scheduler may call wait() from
+ *    any task and with interrupts disabled, so it must be cheap and
+ *    have no side effects.
+ *
+ *    Interrupts are enabled while we wait, and restored to the
+ *    caller's state before we return.
+ */
+
+fastcall void
+Task_Wait(TaskWaitFn wait, void *arg)
+{
+   Task *task = gTaskCurrent;
+   Bool intrFlag = Intr_Save();
+
+   Intr_Enable();
+   task->wait = wait;
+   task->waitArg = arg;
+
+   while (!wait(arg)) {
+      TaskSwitch();
+   }
+
+   task->wait = NULL;
+   Intr_Restore(intrFlag);
+}
+
+
+/*
+ * Task_Signal --
+ *
+ *    Set event bits in every task. Safe to call from an ISR. Tasks
+ *    waiting on these bits are runnable again the next time the
+ *    scheduler looks at them.
+ */
+
+fastcall void
+Task_Signal(uint32 events)
+{
+   Task *task = gTaskCurrent;
+
+   do {
+      Atomic_Or(task->events, events);
+      task = task->next;
+   } while (task != gTaskCurrent);
+}
+
+
+/*
+ * Task_Exit --
+ *
+ *    Remove the current task from the run queue, and switch to the
+ *    next one. If that task is blocked, it just goes back to waiting.
+ *    Never returns.
+ */
+
+void
+Task_Exit(void)
+{
+   Task *task = gTaskCurrent;
+   Task *prev = task;
+
+   if (task == &gTaskMain) {
+      Console_Panic("Main task can't exit");
+   }
+
+   while (prev->next != task) {
+      prev = prev->next;
+   }
+   prev->next = task->next;
+
+   gTaskCurrent = task->next;
+   Intr_RestoreContext(&gTaskCurrent->context);
+}
@@ -0,0 +1,85 @@
+/* -*- Mode: C; c-basic-offset: 3 -*-
+ *
+ * task.h - Cooperative multitasking.
+ *
+ * This file is part of Metalkit, a simple collection of modules for
+ * writing software that runs on the bare metal. Get the latest code
+ * at http://svn.navi.cx/misc/trunk/metalkit/
+ *
+ * Copyright (c) 2008-2009 Micah Dowty
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include "types.h"
+#include "intr.h"
+
+/*
+ * A very small cooperative scheduler, built on IntrContext.
+ *
+ * Tasks run round-robin, and only switch when the running task
+ * calls Task_Yield(), Task_Wait() or Task_Exit(). A task blocked in
+ * Task_Wait() is skipped until its wait function returns TRUE. When
+ * every task is blocked, the scheduler halts until an interrupt
+ * arrives, then checks again.
+ *
+ * Each task also has a word of event bits. Task_Signal(), which is
+ * safe to call from an ISR, sets bits in every task. Each task then
+ * consumes them on its own, so one waiter can't steal an event from
+ * another. The bits mean whatever the signaller wants; the SVGA
+ * driver uses its SVGA_IRQFLAG_* values (see Task_WaitIRQ).
+ *
+ * Any task may wait on SVGA fences and IRQs, but SVGA FIFO commands
+ * must all come from one task. SVGA_FIFOReserve can block, and
+ * another task reserving in the meantime would panic.
+ *
+ * The thread we booted on is the main task. It always exists, and
+ * it can't exit.
+ */
+
+typedef void (*TaskFn)(void *arg);
+typedef Bool (*TaskWaitFn)(void *arg);
+
+typedef struct Task {
+   IntrContext      context;
+   struct Task     *next;
+   TaskFn           main;
+   void            *arg;
+   TaskWaitFn       wait;       // Blocked until wait(waitArg) is TRUE
+   void            *waitArg;
+   volatile uint32  events;     // Set by Task_Signal
+} Task;
+
+extern Task *gTaskCurrent;
+extern Bool gTaskPollIdle;
+
+fastcall void Task_Create(Task *task, uint32 *stack, uint32 stackWords,
+                          TaskFn main, void *arg);
+fastcall Bool Task_Yield(void);
+fastcall void Task_Wait(TaskWaitFn wait, void *arg);
+fastcall void Task_Signal(uint32 events);
+void Task_Exit(void);
+
+#endif /* __TASK_H__ */
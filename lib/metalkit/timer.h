@@ -40,4 +40,18 @@
 
 fastcall void Timer_InitPIT(uint16 divisor);
 
+/*
+ * Timer_GetTSC --
+ *
+ *    Read the CPU's 64-bit timestamp counter.
+ */
+
+static inline uint64
+Timer_GetTSC(void)
+{
+   uint64 tsc;
+   asm volatile ("rdtsc" : "=A" (tsc));
+   return tsc;
+}
+
 #endif /* __TIMER_H__ */
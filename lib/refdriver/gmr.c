@@ -31,35 +31,133 @@
 
 #include "svga.h"
 #include "gmr.h"
+#include "e820.h"
 
 /*
  * Global data
  */
 
-static uint32 heapTop;
 GMRState gGMR;
 
 
+/*
+ * GMR ID allocator state. IDs are handed out from the top of the ID
+ * space down, so they stay out of the way of apps which still pick
+ * small fixed IDs by hand. A released ID stays in the GMR_RELEASING
+ * state until the fence inserted at release time has passed.
+ */
+
+typedef enum {
+   GMR_FREE = 0,
+   GMR_ALLOCATED,
+   GMR_RELEASING,
+} GMRSlotState;
+
+typedef struct GMRSlot {
+   uint8    state;
+   uint32   fence;        // Release fence, in the GMR_RELEASING state
+   PPN      firstPage;    // Backing pages we own, or 0
+   uint32   numPages;
+} GMRSlot;
+
+static struct {
+   GMRSlot  slots[GMR_MAX_ALLOC_IDS];
+   uint32   numReleasing;
+} gmrAlloc;
+
+
+/*
+ * Heap state.
+ *
+ * Pages come from a single region which starts at the end of our
+ * binary image, and ends where the BIOS memory map says usable RAM
+ * ends. 'top' is the boundary between memory we've handed out at some
+ * point and memory we've never touched. Freed page runs go on
+ * an address-ordered free list, and are coalesced with their
+ * neighbours. A run which ends up adjacent to 'top' is returned to the
+ * untouched region, so memory use stays flat when an app repeatedly
+ * allocates and frees.
+ *
+ * Byte allocations are rounded up to a power-of-two size class, with
+ * a small header. Each class has a free list of blocks, carved out of
+ * whole pages. Allocations too large for any class get their own
+ * pages, with the header at the start of the first page.
+ */
+
+#define HEAP_MIN_CLASS_SHIFT   4     // 16 bytes
+#define HEAP_NUM_CLASSES       8     // ... through 2048 bytes
+#define HEAP_LARGE             0x80000000
+#define HEAP_MAGIC_USED        0x48656170
+#define HEAP_MAGIC_FREE        0x46726565
+#define HEAP_PADDING_BYTES     16
+#define HEAP_PADDING_PAGES     1
+#define HEAP_POISON_BYTE       0xAA
+
+typedef struct HeapBlock {
+   uint32 magic;
+   uint32 size;              // Size class, or HEAP_LARGE | number of pages
+} HeapBlock;
+
+typedef struct HeapFreeBlock {
+   HeapBlock              header;
+   struct HeapFreeBlock  *next;
+} HeapFreeBlock;
+
+typedef struct HeapFreeRun {
+   struct HeapFreeRun  *next;
+   uint32               numPages;
+} HeapFreeRun;
+
+static struct {
+   uint32          flags;
+   uint32          top;            // Start of never-allocated memory
+   uint32          limit;          // End of usable RAM, or 0 if unknown
+   Bool            mapped;         // Have we asked the BIOS for a memory map?
+   HeapFreeRun    *freeRuns;       // Sorted by address
+   HeapFreeBlock  *freeBlocks[HEAP_NUM_CLASSES];
+   SVGAMemCounter  bytes;
+   SVGAMemCounter  pages;
+   uint32          peakTop;
+} heap = {
+   .flags = HEAP_DEBUG_PADDING,
+};
+
+
 /*
  *-----------------------------------------------------------------------------
  *
  * Heap_Reset --
- * Heap_Alloc --
- * Heap_AllocPages --
- * Heap_Discard --
- * Heap_DiscardPages --
- * Heap_ProbeMem --
+ * Heap_SetFlags --
+ *
+ *    Forget every allocation, and start allocating again from the top
+ *    of the binary image. Memory is not poisoned, even if
+ *    HEAP_DEBUG_POISON is set.
+ *
+ *    The first reset reads the BIOS E820 memory map, to find out how
+ *    far the heap can grow. If there's no map, we fall back on probing
+ *    each page the first time we hand it out.
+ *
+ *    The flags control debugging features which cost memory or time:
+ *
+ *      HEAP_DEBUG_PADDING: Insert padding between each individual
+ *         memory allocation, to ensure that separate allocations are
+ *         not accidentally contiguous. This is the default.
+ *
+ *      HEAP_DEBUG_POISON: Overwrite memory when it's freed, as
+ *         Heap_Discard does, to ensure its values aren't still being
+ *         used.
  *
- *    Trivial memory heap with 32-bit aligned and page-aligned
- *    allocation. Memory can't be freed, but the entire heap
- *    can be reset.
+ *      HEAP_DEBUG_PROBE: Test memory the first time we hand it out,
+ *         even though the memory map says it's there.
  *
- *    On 'discard', we don't actually free memory- we just write
- *    over it to ensure its values aren't still being used.
+ *    Padding is part of each allocation, so HEAP_DEBUG_PADDING must
+ *    only change while the heap is empty. Flags are preserved across
+ *    Heap_Reset. A flags value of zero is the compact mode.
  *
- *    We insert padding pages between each individual memory
- *    allocation, to ensure that separate allocations are not
- *    accidentally contiguous.
+ *    Heap_Reset zeroes the current usage in the heap statistics, but
+ *    peaks and allocation counts cover the whole run.
+ *
+ *    The heap resets itself on first use.
  *
  *-----------------------------------------------------------------------------
  */
@@ -68,76 +166,533 @@ void
 Heap_Reset(void)
 {
    extern uint8 _end[];
-   heapTop = (uint32) _end;
+   int i;
+
+   heap.top = ((uint32) _end + PAGE_MASK) & ~PAGE_MASK;
+
+   if (!heap.mapped) {
+      heap.mapped = TRUE;
+      if (E820_Init()) {
+         heap.limit = E820_GetRAMLimit(heap.top) & ~PAGE_MASK;
+      }
+   }
+   heap.freeRuns = NULL;
+   for (i = 0; i < HEAP_NUM_CLASSES; i++) {
+      heap.freeBlocks[i] = NULL;
+   }
+   heap.bytes.current = 0;
+   heap.pages.current = 0;
 }
 
 void
-Heap_ProbeMem(volatile uint32 *addr, uint32 size)
+Heap_SetFlags(uint32 flags)
+{
+   heap.flags = flags;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Heap_ProbeMem --
+ *
+ *    Make sure that physical memory exists at the given address, by
+ *    writing and verifying two test patterns. We probe memory the
+ *    first time the heap hands it out, if we have no memory map or
+ *    HEAP_DEBUG_PROBE is set. Probing is slow: it touches every
+ *    dword of the allocation.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Panic if the memory isn't there.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HeapOutOfMemory(void)
+{
+   SVGA_Panic("Out of physical memory.\n\n"
+              "Increase the amount of memory allocated to this VM.\n"
+              "128MB of RAM is recommended.\n");
+}
+
+static Bool
+HeapProbeMem(volatile uint32 *addr, uint32 size)
 {
    const uint32 probe = 0x55AA55AA;
    while (size > sizeof *addr) {
       *addr = probe;
       if (*addr != probe) {
-         goto error;
+         return FALSE;
       }
       *addr = ~probe;
       if (*addr != ~probe) {
-         goto error;
+         return FALSE;
       }
       size -= sizeof *addr;
       addr++;
    }
-   return;
- error:
-   SVGA_Panic("Out of physical memory.\n\n"
-              "Increase the amount of memory allocated to this VM.\n"
-              "128MB of RAM is recommended.\n");
+   return TRUE;
+}
+
+void
+Heap_ProbeMem(volatile uint32 *addr, uint32 size)
+{
+   if (!HeapProbeMem(addr, size)) {
+      HeapOutOfMemory();
+   }
 }
 
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HeapGetPages --
+ *
+ *    Allocate 'numPages' physically contiguous pages, with no padding.
+ *    We take the lowest free run that's large enough, and fall back
+ *    on never-used memory, which must be within the memory map's
+ *    limit or pass a probe.
+ *
+ * Results:
+ *    The first PPN, or 0 if we're out of memory.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static PPN
+HeapGetPages(uint32 numPages)
+{
+   HeapFreeRun **prev = &heap.freeRuns;
+   HeapFreeRun *run;
+   PPN result;
+
+   if (!heap.top) {
+      Heap_Reset();
+   }
+
+   while ((run = *prev)) {
+      if (run->numPages >= numPages) {
+         PPN first = (uint32)run / PAGE_SIZE;
+
+         if (run->numPages == numPages) {
+            *prev = run->next;
+         } else {
+            HeapFreeRun *rest = PPN_POINTER(first + numPages);
+            rest->next = run->next;
+            rest->numPages = run->numPages - numPages;
+            *prev = rest;
+         }
+         SVGA_CountAlloc(&heap.pages, numPages);
+         return first;
+      }
+      prev = &run->next;
+   }
+
+   result = heap.top / PAGE_SIZE;
+
+   if (heap.limit && numPages > (heap.limit - heap.top) / PAGE_SIZE) {
+      return 0;
+   }
+   if ((!heap.limit || (heap.flags & HEAP_DEBUG_PROBE)) &&
+       !HeapProbeMem(PPN_POINTER(result), numPages * PAGE_SIZE)) {
+      return 0;
+   }
+   heap.top += numPages * PAGE_SIZE;
+   heap.peakTop = MAX(heap.peakTop, heap.top);
+   SVGA_CountAlloc(&heap.pages, numPages);
+
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HeapPutPages --
+ *
+ *    Return pages to the free list, merging them with adjacent free
+ *    runs and with the never-used region at heap.top.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Poisons the pages, if HEAP_DEBUG_POISON is set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+#define HEAP_RUN_END(run)  ((uint32)(run) + (run)->numPages * PAGE_SIZE)
+
+static void
+HeapPutPages(PPN firstPage, uint32 numPages)
+{
+   HeapFreeRun *run = PPN_POINTER(firstPage);
+   HeapFreeRun *before = NULL;
+   HeapFreeRun *after = heap.freeRuns;
+
+   SVGA_CountFree(&heap.pages, numPages);
+
+   if (heap.flags & HEAP_DEBUG_POISON) {
+      Heap_DiscardPages(firstPage, numPages);
+   }
+
+   while (after && after < run) {
+      before = after;
+      after = after->next;
+   }
+
+   run->numPages = numPages;
+   run->next = after;
+
+   if (after && HEAP_RUN_END(run) == (uint32)after) {
+      run->numPages += after->numPages;
+      run->next = after->next;
+   }
+
+   if (!before) {
+      heap.freeRuns = run;
+   } else if (HEAP_RUN_END(before) == (uint32)run) {
+      before->numPages += run->numPages;
+      before->next = run->next;
+      run = before;
+   } else {
+      before->next = run;
+   }
+
+   if (!run->next && HEAP_RUN_END(run) == heap.top) {
+      HeapFreeRun **prev = &heap.freeRuns;
+
+      while (*prev != run) {
+         prev = &(*prev)->next;
+      }
+      *prev = NULL;
+      heap.top = (uint32)run;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HeapGrowClass --
+ *
+ *    Carve a fresh page into free blocks for size class 'cls'.
+ *
+ * Results:
+ *    FALSE if we're out of memory.
+ *
+ * Side effects:
+ *    The page belongs to this size class from now on.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HeapGrowClass(uint32 cls)
+{
+   const uint32 blockSize = 1 << (cls + HEAP_MIN_CLASS_SHIFT);
+   PPN page = HeapGetPages(1);
+   uint8 *block;
+
+   if (!page) {
+      return FALSE;
+   }
+
+   for (block = PPN_POINTER(page);
+        block < (uint8*)PPN_POINTER(page + 1);
+        block += blockSize) {
+      HeapFreeBlock *free = (HeapFreeBlock*) block;
+      free->header.magic = HEAP_MAGIC_FREE;
+      free->header.size = cls;
+      free->next = heap.freeBlocks[cls];
+      heap.freeBlocks[cls] = free;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HeapBlockSize --
+ *
+ *    How much memory a block takes up, including its header.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HeapBlockSize(const HeapBlock *block)
+{
+   if (block->size & HEAP_LARGE) {
+      return (block->size & ~HEAP_LARGE) * PAGE_SIZE;
+   }
+   return 1 << (block->size + HEAP_MIN_CLASS_SHIFT);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Heap_Alloc --
+ * Heap_TryAlloc --
+ * Heap_Free --
+ *
+ *    Allocate and free 8-byte aligned memory. Heap_Alloc panics if
+ *    we're out of memory, Heap_TryAlloc returns NULL. Freeing NULL
+ *    is allowed, freeing anything else twice is a panic.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
 void *
-Heap_Alloc(uint32 bytes)
+Heap_TryAlloc(uint32 bytes)
 {
-   const uint32 padding = 16;
-   void *result;
+   uint32 size = bytes + sizeof(HeapBlock);
+   HeapBlock *block;
+   uint32 cls = 0;
+
+   if (heap.flags & HEAP_DEBUG_PADDING) {
+      size += HEAP_PADDING_BYTES;
+   }
+
+   while (cls < HEAP_NUM_CLASSES && size > (1 << (cls + HEAP_MIN_CLASS_SHIFT))) {
+      cls++;
+   }
 
-   heapTop = (heapTop + 3) & ~3;
-   result = (void*) heapTop;
+   if (cls == HEAP_NUM_CLASSES) {
+      uint32 numPages = (size + PAGE_MASK) / PAGE_SIZE;
+      PPN page = HeapGetPages(numPages);
 
-   bytes += padding;
-   heapTop += bytes;
-   Heap_ProbeMem(result, bytes);
+      if (!page) {
+         return NULL;
+      }
+      block = PPN_POINTER(page);
+      block->size = HEAP_LARGE | numPages;
+
+   } else {
+      if (!heap.freeBlocks[cls] && !HeapGrowClass(cls)) {
+         return NULL;
+      }
+      block = &heap.freeBlocks[cls]->header;
+      heap.freeBlocks[cls] = heap.freeBlocks[cls]->next;
+
+      if (block->magic != HEAP_MAGIC_FREE || block->size != cls) {
+         SVGA_Panic("Heap corrupted.");
+      }
+   }
+
+   block->magic = HEAP_MAGIC_USED;
+   SVGA_CountAlloc(&heap.bytes, HeapBlockSize(block));
+   return block + 1;
+}
 
+void *
+Heap_Alloc(uint32 bytes)
+{
+   void *result = Heap_TryAlloc(bytes);
+
+   if (!result) {
+      HeapOutOfMemory();
+   }
    return result;
 }
 
-PPN
-Heap_AllocPages(uint32 numPages)
+void
+Heap_Free(void *data)
 {
-   const uint32 padding = 1;
-   PPN result;
-   uint32 bytes;
+   HeapBlock *block = (HeapBlock*)data - 1;
+
+   if (!data) {
+      return;
+   }
+
+   if (block->magic != HEAP_MAGIC_USED) {
+      SVGA_Panic("Heap_Free: Bad pointer, or already freed.");
+   }
+   SVGA_CountFree(&heap.bytes, HeapBlockSize(block));
+
+   if (block->size & HEAP_LARGE) {
+      HeapPutPages((uint32)block / PAGE_SIZE, block->size & ~HEAP_LARGE);
+
+   } else {
+      uint32 cls = block->size;
+      HeapFreeBlock *free = (HeapFreeBlock*) block;
+
+      if (heap.flags & HEAP_DEBUG_POISON) {
+         Heap_Discard(data, (1 << (cls + HEAP_MIN_CLASS_SHIFT)) - sizeof *block);
+      }
+
+      free->header.magic = HEAP_MAGIC_FREE;
+      free->next = heap.freeBlocks[cls];
+      heap.freeBlocks[cls] = free;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Heap_AllocPages --
+ * Heap_TryAllocPages --
+ * Heap_FreePages --
+ *
+ *    Allocate and free physically contiguous pages. The caller must
+ *    free exactly the same number of pages it allocated.
+ *    Heap_AllocPages panics if we're out of memory,
+ *    Heap_TryAllocPages returns 0.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   heapTop = (heapTop + PAGE_MASK) & ~PAGE_MASK;
-   result = heapTop / PAGE_SIZE;
+PPN
+Heap_TryAllocPages(uint32 numPages)
+{
+   if (heap.flags & HEAP_DEBUG_PADDING) {
+      numPages += HEAP_PADDING_PAGES;
+   }
+   return HeapGetPages(numPages);
+}
 
-   numPages += padding;
-   bytes = numPages * PAGE_SIZE;
-   heapTop += bytes;
-   Heap_ProbeMem(PPN_POINTER(result), bytes);
+PPN
+Heap_AllocPages(uint32 numPages)
+{
+   PPN result = Heap_TryAllocPages(numPages);
 
+   if (!result) {
+      HeapOutOfMemory();
+   }
    return result;
 }
 
+void
+Heap_FreePages(PPN firstPage, uint32 numPages)
+{
+   if (heap.flags & HEAP_DEBUG_PADDING) {
+      numPages += HEAP_PADDING_PAGES;
+   }
+   HeapPutPages(firstPage, numPages);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Heap_Discard --
+ * Heap_DiscardPages --
+ *
+ *    We don't actually free memory here- we just write over it to
+ *    ensure its values aren't still being used.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
 void
 Heap_Discard(void *data, uint32 bytes)
 {
-   memset(data, 0xAA, bytes);
+   memset(data, HEAP_POISON_BYTE, bytes);
 }
 
 void
 Heap_DiscardPages(PPN firstPage, uint32 numPages)
 {
-   memset(PPN_POINTER(firstPage), 0xAA, numPages * PAGE_SIZE);
+   memset(PPN_POINTER(firstPage), HEAP_POISON_BYTE, numPages * PAGE_SIZE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Heap_GetStats --
+ *
+ *    Report heap usage. 'pages' is the real cost in memory: it counts
+ *    the pages carved into size classes, padding, and page
+ *    allocations. 'bytes' only counts Heap_Alloc. The footprint is
+ *    how far the heap has grown past our binary image; freed memory
+ *    below the top still counts.
+ *
+ * Results:
+ *    Fills in 'stats'.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Heap_GetStats(HeapStats *stats)  // OUT
+{
+   extern uint8 _end[];
+   uint32 base = ((uint32) _end + PAGE_MASK) & ~PAGE_MASK;
+
+   if (!heap.top) {
+      Heap_Reset();
+   }
+
+   stats->bytes = heap.bytes;
+   stats->pages = heap.pages;
+   stats->footprint = heap.top - base;
+   stats->peakFootprint = MAX(heap.peakTop, heap.top) - base;
+   stats->limit = heap.limit ? heap.limit - base : 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMRNextRun --
+ *
+ *    Pull the next run of physically contiguous pages out of a flat
+ *    array of descriptors, merging adjacent descriptors. Empty
+ *    descriptors are skipped; in a descriptor page they would look
+ *    like the end of the list.
+ *
+ * Results:
+ *    FALSE if there are no more runs. Otherwise, fills in 'run' and
+ *    advances 'descArray' and 'numDescriptors' past it.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+GMRNextRun(SVGAGuestMemDescriptor **descArray,  // IN/OUT
+           uint32 *numDescriptors,              // IN/OUT
+           SVGAGuestMemDescriptor *run)         // OUT
+{
+   run->numPages = 0;
+
+   while (*numDescriptors) {
+      SVGAGuestMemDescriptor *desc = *descArray;
+
+      if (desc->numPages) {
+         if (!run->numPages) {
+            *run = *desc;
+         } else if (run->ppn + run->numPages == desc->ppn &&
+                    run->numPages + desc->numPages > run->numPages) {
+            run->numPages += desc->numPages;
+         } else {
+            break;
+         }
+      }
+
+      (*descArray)++;
+      (*numDescriptors)--;
+   }
+
+   return run->numPages != 0;
 }
 
 
@@ -151,12 +706,19 @@ Heap_DiscardPages(PPN firstPage, uint32 numPages)
  *    pages. The result is a PPN which is suitable to give directly to
  *    the SVGA device's GMR_DESCRIPTOR register.
  *
+ *    Descriptors for physically adjacent pages are merged into a
+ *    single descriptor, so callers can describe a GMR page by page
+ *    without paying for it in descriptor memory or host walk time.
+ *    The merged list must fit in gGMR.maxDescriptorLen. gGMR keeps
+ *    track of how well merging is working.
+ *
  * Results:
  *    If numDescriptors is zero, returns zero. otherwise, returns
  *    a physical page number.
  *
  * Side effects:
- *    Allocates (and never frees) memory for the GMR descriptor.
+ *    Allocates memory for the GMR descriptor.
+ *    Panics if the descriptor list is too long.
  *
  *-----------------------------------------------------------------------------
  */
@@ -167,32 +729,46 @@ GMR_AllocDescriptor(SVGAGuestMemDescriptor *descArray,
 {
    const uint32 descPerPage = PAGE_SIZE / sizeof(SVGAGuestMemDescriptor) - 1;
    SVGAGuestMemDescriptor *desc = NULL;
+   SVGAGuestMemDescriptor run;
    PPN firstPage = 0;
    PPN page = 0;
+   uint32 numRuns = 0;
    int i = 0;
 
-   while (numDescriptors) {
-      if (!firstPage) {
-         firstPage = page = Heap_AllocPages(1);
+   {
+      SVGAGuestMemDescriptor *countArray = descArray;
+      uint32 countLeft = numDescriptors;
+
+      while (GMRNextRun(&countArray, &countLeft, &run)) {
+         numRuns++;
       }
+   }
 
-      desc = PPN_POINTER(page);
+   if (gGMR.maxDescriptorLen && numRuns > gGMR.maxDescriptorLen) {
+      SVGA_Panic("GMR descriptor list is too long.");
+   }
 
-      if (i == descPerPage) {
+   gGMR.descriptorsIn += numDescriptors;
+   gGMR.descriptorsOut += numRuns;
+
+   while (GMRNextRun(&descArray, &numDescriptors, &run)) {
+      if (!firstPage) {
+         firstPage = page = Heap_AllocPages(1);
+         gGMR.descriptorPages++;
+      } else if (i == descPerPage) {
          /*
           * Terminate this page with a pointer to the next one.
           */
          page = Heap_AllocPages(1);
+         gGMR.descriptorPages++;
          desc[i].ppn = page;
          desc[i].numPages = 0;
          i = 0;
-         continue;
       }
 
-      desc[i] = *descArray;
+      desc = PPN_POINTER(page);
+      desc[i] = run;
       i++;
-      descArray++;
-      numDescriptors--;
    }
 
    if (desc) {
@@ -205,6 +781,42 @@ GMR_AllocDescriptor(SVGAGuestMemDescriptor *descArray,
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMRFreeDescriptor --
+ *
+ *    Free every page in a descriptor list from GMR_AllocDescriptor.
+ *    Each page is clobbered before it's freed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Frees memory.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+GMRFreeDescriptor(PPN page)
+{
+   while (page) {
+      SVGAGuestMemDescriptor *desc = PPN_POINTER(page);
+      PPN next;
+
+      while (desc->numPages) {
+         desc++;
+      }
+      next = desc->ppn;
+
+      Heap_DiscardPages(page, 1);
+      Heap_FreePages(page, 1);
+      page = next;
+   }
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -219,7 +831,6 @@ GMR_AllocDescriptor(SVGAGuestMemDescriptor *descArray,
  *
  * Side effects:
  *    Defines or redefines a GMR in the SVGA device.
- *    Allocates (and never frees) memory for the GMR descriptor.
  *
  *-----------------------------------------------------------------------------
  */
@@ -239,12 +850,40 @@ GMR_Define(uint32 gmrId,
    SVGA_WriteReg(SVGA_REG_GMR_ID, gmrId);
    SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, desc);
 
-   if (desc) {
-      /*
-       * Clobber the first page, to verify that the device reads our
-       * descriptors synchronously when we write the GMR registers.
-       */
-      Heap_DiscardPages(desc, 1);
+   /*
+    * The device reads our descriptors synchronously when we write the
+    * GMR registers, so we can free them right away. Freeing clobbers
+    * the first page, to verify that.
+    */
+   GMRFreeDescriptor(desc);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMRSetBacking --
+ *
+ *    Remember the pages backing an allocated GMR, so GMR_Release can
+ *    free them. Pages behind IDs that weren't allocated by
+ *    GMR_AllocId are the caller's problem.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+GMRSetBacking(uint32 gmrId, PPN firstPage, uint32 numPages)
+{
+   if (gmrId < GMR_MAX_ALLOC_IDS &&
+       gmrAlloc.slots[gmrId].state == GMR_ALLOCATED) {
+      gmrAlloc.slots[gmrId].firstPage = firstPage;
+      gmrAlloc.slots[gmrId].numPages = numPages;
    }
 }
 
@@ -253,34 +892,53 @@ GMR_Define(uint32 gmrId,
  *-----------------------------------------------------------------------------
  *
  * GMR_DefineContiguous --
+ * GMR_TryDefineContiguous --
  *
  *    Allocate and define a physically contiguous GMR, consisting of a
- *    single SVGAGuestMemDescriptor.
+ *    single SVGAGuestMemDescriptor. If we're out of memory,
+ *    GMR_DefineContiguous panics, and GMR_TryDefineContiguous
+ *    returns 0 without defining anything.
  *
  * Results:
  *    Returns the first PPN of the allocated GMR region. All of
  *    'numPages' subsequent PPNs are also part of the GMR.
  *
  * Side effects:
- *    Allocates and never frees memory for the GMR descriptor and for
- *    the GMR contents itself.
+ *    Allocates memory for the GMR contents. If the GMR ID came from
+ *    GMR_AllocId, GMR_Release frees it. Otherwise it's never freed.
  *
  *-----------------------------------------------------------------------------
  */
 
 PPN
-GMR_DefineContiguous(uint32 gmrId, uint32 numPages)
+GMR_TryDefineContiguous(uint32 gmrId, uint32 numPages)
 {
    SVGAGuestMemDescriptor desc = {
-      .ppn = Heap_AllocPages(numPages),
+      .ppn = Heap_TryAllocPages(numPages),
       .numPages = numPages,
    };
 
+   if (!desc.ppn) {
+      return 0;
+   }
+
    GMR_Define(gmrId, &desc, 1);
+   GMRSetBacking(gmrId, desc.ppn, numPages);
 
    return desc.ppn;
 }
 
+PPN
+GMR_DefineContiguous(uint32 gmrId, uint32 numPages)
+{
+   PPN result = GMR_TryDefineContiguous(gmrId, numPages);
+
+   if (!result) {
+      HeapOutOfMemory();
+   }
+   return result;
+}
+
 
 /*
  *-----------------------------------------------------------------------------
@@ -299,8 +957,8 @@ GMR_DefineContiguous(uint32 gmrId, uint32 numPages)
  *    the even-numbered pages in that sequence are mapped into the GMR.
  *
  * Side effects:
- *    Allocates and never frees memory for the GMR descriptor and for
- *    the GMR contents itself.
+ *    Allocates memory for the GMR contents. If the GMR ID came from
+ *    GMR_AllocId, GMR_Release frees it. Otherwise it's never freed.
  *
  *-----------------------------------------------------------------------------
  */
@@ -320,6 +978,8 @@ GMR_DefineEvenPages(uint32 gmrId, uint32 numPages)
    }
 
    GMR_Define(gmrId, desc, numPages);
+   GMRSetBacking(gmrId, region, numPages * 2);
+   Heap_Free(desc);
 
    return region;
 }
@@ -332,9 +992,10 @@ GMR_DefineEvenPages(uint32 gmrId, uint32 numPages)
  *
  *    Undefine all GMRs.
  *
- *    This frees device resources, but it doesn't actually free
- *    any memory from our trivial heap. If you are done with the
- *    heap, call Heap_Reset() separately.
+ *    This frees device resources and forgets every GMR ID from
+ *    GMR_AllocId, but it doesn't actually free any memory from our
+ *    heap. If you are done with the heap, call Heap_Reset()
+ *    separately.
  *
  * Results:
  *    None.
@@ -353,6 +1014,206 @@ GMR_FreeAll(void)
    for (id = 0; id < gGMR.maxIds; id++) {
       GMR_Define(id, NULL, 0);
    }
+   for (id = 0; id < GMR_MAX_ALLOC_IDS; id++) {
+      if (gmrAlloc.slots[id].state != GMR_FREE) {
+         SVGA_CountFree(&gGMR.ids, 1);
+      }
+   }
+   memset(&gmrAlloc, 0, sizeof gmrAlloc);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMRReap --
+ *
+ *    Finish releasing every GMR whose release fence has passed:
+ *    undefine it, free its pages, and make the ID available again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Undefines GMRs, frees memory.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+GMRReap(void)
+{
+   uint32 id;
+
+   for (id = 0; id < GMR_MAX_ALLOC_IDS && gmrAlloc.numReleasing; id++) {
+      GMRSlot *slot = &gmrAlloc.slots[id];
+
+      if (slot->state == GMR_RELEASING && SVGA_HasFencePassed(slot->fence)) {
+         GMR_Define(id, NULL, 0);
+         if (slot->numPages) {
+            Heap_FreePages(slot->firstPage, slot->numPages);
+         }
+         memset(slot, 0, sizeof *slot);
+         gmrAlloc.numReleasing--;
+         SVGA_CountFree(&gGMR.ids, 1);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_TryAllocId --
+ * GMR_AllocId --
+ *
+ *    Allocate an unused GMR ID. If every ID is in use but some are
+ *    waiting to be released, we wait for the oldest release fence.
+ *
+ *    GMR_TryAllocId returns FALSE if no IDs are available at all,
+ *    GMR_AllocId panics.
+ *
+ * Results:
+ *    The new GMR ID.
+ *
+ * Side effects:
+ *    May reap released GMRs, or SVGA_SyncToFence().
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+GMR_TryAllocId(uint32 *gmrId)  // OUT
+{
+   uint32 maxIds = MIN(gGMR.maxIds, GMR_MAX_ALLOC_IDS);
+   uint32 id;
+
+   GMRReap();
+
+   while (1) {
+      GMRSlot *oldest = NULL;
+
+      for (id = maxIds; id > 0; id--) {
+         GMRSlot *slot = &gmrAlloc.slots[id - 1];
+
+         if (slot->state == GMR_FREE) {
+            slot->state = GMR_ALLOCATED;
+            *gmrId = id - 1;
+            SVGA_CountAlloc(&gGMR.ids, 1);
+            return TRUE;
+         }
+         if (slot->state == GMR_RELEASING &&
+             (!oldest || (int32)(slot->fence - oldest->fence) < 0)) {
+            oldest = slot;
+         }
+      }
+
+      if (!oldest) {
+         return FALSE;
+      }
+
+      SVGA_SyncToFence(oldest->fence);
+      GMRReap();
+   }
+}
+
+uint32
+GMR_AllocId(void)
+{
+   uint32 gmrId;
+
+   if (!GMR_TryAllocId(&gmrId)) {
+      SVGA_Panic("Out of GMR IDs.");
+   }
+   return gmrId;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMRReleaseAfter --
+ *
+ *    Mark an allocated GMR ID for release once 'fence' has passed.
+ *    Zero is a fence which has always passed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Panics if the ID isn't allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+GMRReleaseAfter(uint32 gmrId, uint32 fence)
+{
+   GMRSlot *slot;
+
+   if (gmrId >= GMR_MAX_ALLOC_IDS ||
+       gmrAlloc.slots[gmrId].state != GMR_ALLOCATED) {
+      SVGA_Panic("GMR_Release: GMR ID not allocated.");
+   }
+   slot = &gmrAlloc.slots[gmrId];
+
+   slot->fence = fence;
+   slot->state = GMR_RELEASING;
+   gmrAlloc.numReleasing++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_Release --
+ *
+ *    Release a GMR ID from GMR_AllocId. Commands already in the FIFO
+ *    may still refer to the GMR, so we insert a fence and only
+ *    undefine it, free its backing pages, and reuse the ID once the
+ *    host has passed that fence.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Inserts a fence.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_Release(uint32 gmrId)
+{
+   GMRReleaseAfter(gmrId, SVGA_InsertFence());
+   GMRReap();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_ReleaseNow --
+ *
+ *    Release a GMR ID which the host is already done with, for example
+ *    from an async call whose fence has passed. Unlike GMR_Release,
+ *    this doesn't touch the FIFO or the device, so it's safe from the
+ *    SVGA bottom half. The GMR is undefined and its pages are freed
+ *    by the next GMR_AllocId or GMR_Release.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_ReleaseNow(uint32 gmrId)
+{
+   GMRReleaseAfter(gmrId, 0);
 }
 
 
@@ -410,3 +1271,155 @@ GMR2_Init(void)
       SVGA_Panic("Virtual device does not have Guest Memory Region version 2 (GMR2) support.");
    }
 }
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_Define2 --
+ *
+ *    Define (or redefine) a GMR2 with room for 'numPages' pages, using
+ *    the FIFO instead of the GMR registers. All pages start out
+ *    unmapped; map them with one of the GMR_Remap2 functions. Defining
+ *    a GMR with zero pages undefines it.
+ *
+ *    Unlike GMR_Define, this is asynchronous: it's ordered with
+ *    respect to other FIFO commands, and costs no VM exits. Requires
+ *    GMR2_Init.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Writes to the FIFO.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_Define2(uint32 gmrId, uint32 numPages)
+{
+   SVGAFifoCmdDefineGMR2 *cmd = SVGA_FIFOReserveCmd(SVGA_CMD_DEFINE_GMR2, sizeof *cmd);
+   cmd->gmrId = gmrId;
+   cmd->numPages = numPages;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_Remap2 --
+ *
+ *    Map 'numPages' pages of a GMR2, starting at page 'offsetPages',
+ *    to the physical pages listed in 'ppns'. The PPN list is copied
+ *    into the FIFO, so the caller can reuse it right away. Large
+ *    remaps are split into several commands.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Writes to the FIFO.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_Remap2(uint32 gmrId,
+           uint32 offsetPages,
+           uint32 numPages,
+           const PPN *ppns)
+{
+   while (numPages) {
+      uint32 count = MIN(numPages, GMR2_MAX_INLINE_PPNS);
+      SVGAFifoCmdRemapGMR2 *cmd;
+
+      cmd = SVGA_FIFOReserveCmd(SVGA_CMD_REMAP_GMR2,
+                                sizeof *cmd + count * sizeof(uint32));
+      cmd->gmrId = gmrId;
+      cmd->flags = SVGA_REMAP_GMR2_PPN32;
+      cmd->offsetPages = offsetPages;
+      cmd->numPages = count;
+      memcpy(cmd + 1, ppns, count * sizeof(uint32));
+      SVGA_FIFOCommitAll();
+
+      ppns += count;
+      offsetPages += count;
+      numPages -= count;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_Remap2ViaGMR --
+ *
+ *    Like GMR_Remap2, but the host reads the list of 32-bit PPNs from
+ *    guest memory at 'ppnList' instead of from the FIFO. This keeps
+ *    very large remaps out of the FIFO. The list must not be in the
+ *    part of the GMR being remapped, and it must stay valid until the
+ *    host has processed the command.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Writes to the FIFO.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_Remap2ViaGMR(uint32 gmrId,
+                 uint32 offsetPages,
+                 uint32 numPages,
+                 SVGAGuestPtr ppnList)
+{
+   SVGAFifoCmdRemapGMR2 *cmd;
+
+   cmd = SVGA_FIFOReserveCmd(SVGA_CMD_REMAP_GMR2, sizeof *cmd + sizeof ppnList);
+   cmd->gmrId = gmrId;
+   cmd->flags = SVGA_REMAP_GMR2_VIA_GMR;
+   cmd->offsetPages = offsetPages;
+   cmd->numPages = numPages;
+   memcpy(cmd + 1, &ppnList, sizeof ppnList);
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * GMR_Remap2Single --
+ *
+ *    Map every page in a range of a GMR2 to the same physical page.
+ *    This is useful for pointing unused parts of a GMR at a scratch
+ *    page.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Writes to the FIFO.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+GMR_Remap2Single(uint32 gmrId,
+                 uint32 offsetPages,
+                 uint32 numPages,
+                 PPN ppn)
+{
+   SVGAFifoCmdRemapGMR2 *cmd;
+
+   cmd = SVGA_FIFOReserveCmd(SVGA_CMD_REMAP_GMR2, sizeof *cmd + sizeof(uint32));
+   cmd->gmrId = gmrId;
+   cmd->flags = SVGA_REMAP_GMR2_SINGLE_PPN;
+   cmd->offsetPages = offsetPages;
+   cmd->numPages = numPages;
+   *(uint32*)(cmd + 1) = ppn;
+   SVGA_FIFOCommitAll();
+}
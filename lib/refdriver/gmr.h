@@ -32,7 +32,7 @@
 #ifndef __GMR_H__
 #define __GMR_H__
 
-#include "svga_reg.h"
+#include "svga.h"
 
 /*
  * Macros for physical memory pages, in our flat memory model.
@@ -55,23 +55,53 @@ typedef struct GMRState {
    uint32 maxIds;
    uint32 maxDescriptorLen;
    uint32 maxPages;
+
+   /*
+    * Descriptor statistics, from GMR_AllocDescriptor: how many
+    * descriptors we were given, how many were left after merging
+    * adjacent pages, and how many pages they took up.
+    */
+   uint32 descriptorsIn;
+   uint32 descriptorsOut;
+   uint32 descriptorPages;
+
+   /* IDs handed out by GMR_AllocId, until they're reclaimed. */
+   SVGAMemCounter ids;
 } GMRState;
 
 extern GMRState gGMR;
 
 
 /*
- * Trivial memory heap, used as system memory backings for GMRs. We
- * never actually free any memory, we just allocate starting from the
- * top of the binary image and we grow upward until we hit physical
- * memory which isn't present.
+ * Simple memory heap, used as system memory backings for GMRs. We
+ * allocate starting from the top of the binary image and grow upward
+ * until we reach the end of usable RAM, according to the BIOS memory
+ * map. Freed memory is reused.
  */
 
+#define HEAP_DEBUG_PADDING   (1 << 0)   // Keep allocations apart (default)
+#define HEAP_DEBUG_POISON    (1 << 1)   // Overwrite memory on free
+#define HEAP_DEBUG_PROBE     (1 << 2)   // Test memory before first use
+
+typedef struct HeapStats {
+   SVGAMemCounter bytes;       // Heap_Alloc, rounded up to the block size
+   SVGAMemCounter pages;       // All pages in use, including padding
+   uint32         footprint;   // Bytes from the end of the image to the top
+   uint32         peakFootprint;
+   uint32         limit;       // Bytes the heap can grow to, or 0 if unknown
+} HeapStats;
+
 void Heap_Reset(void);
+void Heap_SetFlags(uint32 flags);
 void *Heap_Alloc(uint32 bytes);
+void *Heap_TryAlloc(uint32 bytes);
+void Heap_Free(void *data);
 PPN Heap_AllocPages(uint32 numPages);
+PPN Heap_TryAllocPages(uint32 numPages);
+void Heap_FreePages(PPN firstPage, uint32 numPages);
 void Heap_Discard(void *data, uint32 bytes);
 void Heap_DiscardPages(PPN firstPage, uint32 numPages);
+void Heap_GetStats(HeapStats *stats);
 
 
 /*
@@ -91,6 +121,20 @@ PPN GMR_AllocDescriptor(SVGAGuestMemDescriptor *descArray,
                         uint32 numDescriptors);
 
 
+/*
+ * Allocating GMR IDs. Released IDs (and the pages backing them, if
+ * they were defined with GMR_DefineContiguous or GMR_DefineEvenPages)
+ * are reclaimed once the FIFO has moved past the release point.
+ */
+
+#define GMR_MAX_ALLOC_IDS  1024
+
+Bool GMR_TryAllocId(uint32 *gmrId);
+uint32 GMR_AllocId(void);
+void GMR_Release(uint32 gmrId);
+void GMR_ReleaseNow(uint32 gmrId);
+
+
 /*
  * Creating/destroying GMRs
  */
@@ -99,8 +143,26 @@ void GMR_Define(uint32 gmrId,
                 SVGAGuestMemDescriptor *descArray,
                 uint32 numDescriptors);
 PPN GMR_DefineContiguous(uint32 gmrId, uint32 numPages);
+PPN GMR_TryDefineContiguous(uint32 gmrId, uint32 numPages);
 PPN GMR_DefineEvenPages(uint32 gmrId, uint32 numPages);
 void GMR_FreeAll(void);
 
 
+/*
+ * Defining and remapping GMR2s through the FIFO. These are queued
+ * along with other commands, instead of being processed synchronously
+ * like GMR_Define.
+ */
+
+#define GMR2_MAX_INLINE_PPNS  1024
+
+void GMR_Define2(uint32 gmrId, uint32 numPages);
+void GMR_Remap2(uint32 gmrId, uint32 offsetPages, uint32 numPages,
+                const PPN *ppns);
+void GMR_Remap2ViaGMR(uint32 gmrId, uint32 offsetPages, uint32 numPages,
+                      SVGAGuestPtr ppnList);
+void GMR_Remap2Single(uint32 gmrId, uint32 offsetPages, uint32 numPages,
+                      PPN ppn);
+
+
 #endif /* __GMR_H__ */
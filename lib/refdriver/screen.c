@@ -68,7 +68,9 @@ Screen_Init(void)
  *
  *    Create an SVGA Screen Object.
  *
- *    Also create the backing store when supported/required.
+ *    Also create the backing store when supported/required. Every
+ *    backing store lives at the start of VRAM, so we just make sure
+ *    enough of it is reserved for this screen.
  *
  * Results:
  *    None.
@@ -86,7 +88,8 @@ Screen_Create(SVGAScreenObject *screen)  // IN/OUT
       const uint32 pitch = screen->size.width * sizeof(uint32);
       const uint32 size = screen->size.height*pitch;
       screen->structSize = sizeof(SVGAScreenObject);
-      SVGA_AllocGMR(size, &screen->backingStore.ptr);
+      SVGA_ReserveVRAM(size);
+      screen->backingStore.ptr.gmrId = SVGA_GMR_FRAMEBUFFER;
       screen->backingStore.ptr.offset = 0;
       screen->backingStore.pitch = pitch;
    } else {
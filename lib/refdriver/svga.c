@@ -36,14 +36,25 @@
 #include "console_vga.h"
 #include "io.h"
 #include "intr.h"
+#include "timer.h"
+#include "task.h"
 #include "svga_reg.h"
 
 SVGADevice gSVGA;
 
+/*
+ * How many times the legacy SyncToFence path polls the FIFO fence
+ * between reads of SVGA_REG_BUSY.
+ */
+#define SVGA_FENCE_POLL_SPINS  1000
+
 static void SVGAFIFOFull(void);
 
 #ifndef REALLY_TINY
 static void SVGAInterruptHandler(int vector);
+static void SVGASetIRQMask(uint32 mask);
+#else
+#define SVGASetIRQMask(x)
 #endif
 
 #ifdef REALLY_TINY
@@ -162,6 +173,7 @@ SVGA_Init(void)
 
       /* Start out with all SVGA IRQs masked */
       SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+      gSVGA.irq.mask = 0;
 
       /* Clear all pending IRQs stored by the device */
       IO_Out32(gSVGA.ioBase + SVGA_IRQSTATUS_PORT, 0xFF);
@@ -245,7 +257,7 @@ SVGA_Enable(void)
 #ifndef REALLY_TINY
    if (gSVGA.capabilities & SVGA_CAP_IRQMASK) {
 
-      SVGA_WriteReg(SVGA_REG_IRQMASK, SVGA_IRQFLAG_ANY_FENCE);
+      SVGASetIRQMask(SVGA_IRQFLAG_ANY_FENCE);
       SVGA_ClearIRQ();
 
       SVGA_InsertFence();
@@ -253,10 +265,10 @@ SVGA_Enable(void)
       SVGA_WriteReg(SVGA_REG_SYNC, 1);
       while (SVGA_ReadReg(SVGA_REG_BUSY) != FALSE);
 
-      SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+      SVGASetIRQMask(0);
 
       /* Check whether the interrupt occurred without blocking. */
-      if ((gSVGA.irq.pending & SVGA_IRQFLAG_ANY_FENCE) == 0) {
+      if ((gTaskCurrent->events & SVGA_IRQFLAG_ANY_FENCE) == 0) {
          SVGA_Panic("SVGA IRQ appears to be present but broken.");
       }
 
@@ -342,13 +354,61 @@ SVGA_SetMode(uint32 width,   // IN
  */
 
 #ifndef REALLY_TINY
+static SVGAPanicFn panicHook;
+
 void
 SVGA_Panic(const char *msg)  // IN
 {
+   SVGAPanicFn hook = panicHook;
+
    SVGA_Disable();
    ConsoleVGA_Init();
+
+   if (hook) {
+      /*
+       * Console_Panic clears the screen, so print the message
+       * ourselves, then let the hook add to it. Clear the hook
+       * first, in case it panics too.
+       */
+      panicHook = NULL;
+      Console_BeginPanic();
+      Console_WriteString("Panic:\n");
+      Console_WriteString(msg);
+      Console_WriteString("\n\n");
+      hook();
+      Console_Flush();
+      Intr_Disable();
+      Intr_Halt();
+   }
+
    Console_Panic(msg);
 }
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_SetPanicHook --
+ *
+ *      Install a function for SVGA_Panic to run after it switches
+ *      back to VGA text mode and prints the panic message. This is a
+ *      place to dump diagnostics which explain the panic, like
+ *      memory usage. The hook runs at most once.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces any previous hook.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_SetPanicHook(SVGAPanicFn fn)  // IN (optional)
+{
+   panicHook = fn;
+}
 #endif
 
 
@@ -401,6 +461,11 @@ SVGA_DefaultFaultHandler(int vector)  // IN
 uint32
 SVGA_ReadReg(uint32 index)  // IN
 {
+#ifndef REALLY_TINY
+   gSVGA.regs.reads[MIN(index, SVGA_REG_TOP)]++;
+   gSVGA.regs.total++;
+#endif
+
    IO_Out32(gSVGA.ioBase + SVGA_INDEX_PORT, index);
    return IO_In32(gSVGA.ioBase + SVGA_VALUE_PORT);
 }
@@ -427,6 +492,11 @@ void
 SVGA_WriteReg(uint32 index,  // IN
               uint32 value)  // IN
 {
+#ifndef REALLY_TINY
+   gSVGA.regs.writes[MIN(index, SVGA_REG_TOP)]++;
+   gSVGA.regs.total++;
+#endif
+
    IO_Out32(gSVGA.ioBase + SVGA_INDEX_PORT, index);
    IO_Out32(gSVGA.ioBase + SVGA_VALUE_PORT, value);
 }
@@ -564,6 +634,7 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
    }
 
    gSVGA.fifo.reservedSize = bytes;
+   gSVGA.fifo.peakReserved = MAX(gSVGA.fifo.peakReserved, bytes);
 
    while (1) {
       uint32 stop = fifo[SVGA_FIFO_STOP];
@@ -642,6 +713,7 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
        */
       if (reserveInPlace) {
          if (reserveable || bytes <= sizeof(uint32)) {
+            SVGASetIRQMask(gSVGA.irq.mask & ~SVGA_IRQFLAG_FIFO_PROGRESS);
             gSVGA.fifo.usingBounceBuffer = FALSE;
             if (reserveable) {
                fifo[SVGA_FIFO_RESERVED] = bytes;
@@ -662,7 +734,9 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
        * decided to use a bounce buffer instead.
        */
       if (needBounce) {
+         SVGASetIRQMask(gSVGA.irq.mask & ~SVGA_IRQFLAG_FIFO_PROGRESS);
          gSVGA.fifo.usingBounceBuffer = TRUE;
+         gSVGA.fifo.bounceCount++;
          return gSVGA.fifo.bounceBuffer;
       }
    } /* while (1) */
@@ -707,6 +781,7 @@ SVGA_FIFOCommit(uint32 bytes)  // IN
       SVGA_Panic("FIFOCommit before FIFOReserve");
    }
    gSVGA.fifo.reservedSize = 0;
+   gSVGA.fifo.bytesCommitted += bytes;
 
    if (gSVGA.fifo.usingBounceBuffer) {
       /*
@@ -904,6 +979,8 @@ void
 SVGAFIFOFull(void)
 {
 #ifndef REALLY_TINY
+   uint64 startTSC = Timer_GetTSC();
+
    if (SVGA_IsFIFORegValid(SVGA_FIFO_FENCE_GOAL) &&
        (gSVGA.capabilities & SVGA_CAP_IRQMASK)) {
 
@@ -914,13 +991,18 @@ SVGAFIFOFull(void)
        *
        * As with the IRQ-based SVGA_SyncToFence(), this will only work
        * on Workstation 6.5 virtual machines and later.
+       *
+       * FIFO_PROGRESS interrupts are frequent, so we can't leave them
+       * enabled forever. But we may be called many times in a row
+       * while waiting for space, so rather than toggling the mask on
+       * every call, SVGA_FIFOReserve disables them once it's done
+       * waiting.
        */
 
-      SVGA_WriteReg(SVGA_REG_IRQMASK, SVGA_IRQFLAG_FIFO_PROGRESS);
+      SVGASetIRQMask(gSVGA.irq.mask | SVGA_IRQFLAG_FIFO_PROGRESS);
       SVGA_ClearIRQ();
       SVGA_RingDoorbell();
       SVGA_WaitForIRQ();
-      SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
 
    } else {
 
@@ -934,6 +1016,14 @@ SVGAFIFOFull(void)
       SVGA_WriteReg(SVGA_REG_SYNC, 1);
       SVGA_ReadReg(SVGA_REG_BUSY);
    }
+
+   /*
+    * Account for the time we spent blocked, so that tools like
+    * FIFOMon can tell a guest-bound app from a host-bound one.
+    */
+
+   gSVGA.fifo.fullCycles += Timer_GetTSC() - startTSC;
+   gSVGA.fifo.fullCount++;
 #endif
 }
 
@@ -1003,6 +1093,41 @@ SVGA_InsertFence(void)
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGASetFenceGoal --
+ *
+ *      Ask for a FENCE_GOAL interrupt when 'fence' passes. There's only
+ *      one goal register, so if other tasks are waiting too, we only
+ *      move the goal earlier, or replace one that already passed. A
+ *      waiter whose fence is later wakes up when the earlier goal is
+ *      reached, and sets its own goal then.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write SVGA_FIFO_FENCE_GOAL.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+#ifndef REALLY_TINY
+static void
+SVGASetFenceGoal(uint32 fence)  // IN
+{
+   uint32 goal = gSVGA.fifoMem[SVGA_FIFO_FENCE_GOAL];
+
+   if (gSVGA.irq.fenceWaiters == 1 ||
+       SVGA_HasFencePassed(goal) ||
+       (int32)(fence - goal) < 0) {
+      gSVGA.fifoMem[SVGA_FIFO_FENCE_GOAL] = fence;
+   }
+}
+#endif
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1023,7 +1148,8 @@ SVGA_InsertFence(void)
  *      If the SVGA device and virtual machine hardware version are
  *      both new enough (Workstation 6.5 or later), this will use an
  *      efficient interrupt-driven mechanism to sleep until just after
- *      the host processes the fence.
+ *      the host processes the fence. Only the calling task sleeps;
+ *      other tasks keep running (see task.h).
  *
  *      If not, this will use a less efficient synchronization
  *      mechanism which may require the host to process significantly
@@ -1090,38 +1216,59 @@ SVGA_SyncToFence(uint32 fence)  // IN
        * unset.
        */
 
-      /*
-       * Set the fence goal. This asks the host to send an interrupt
-       * when this specific fence has been reached.
-       */
+      gSVGA.irq.fenceWaiters++;
+      SVGASetIRQMask(gSVGA.irq.mask | SVGA_IRQFLAG_FENCE_GOAL);
 
-      gSVGA.fifoMem[SVGA_FIFO_FENCE_GOAL] = fence;
-      SVGA_WriteReg(SVGA_REG_IRQMASK, SVGA_IRQFLAG_FENCE_GOAL);
+      while (1) {
+         /*
+          * Set the fence goal. This asks the host to send an interrupt
+          * when this specific fence has been reached. Other tasks may
+          * have set a goal of their own; see SVGASetFenceGoal.
+          */
 
-      SVGA_ClearIRQ();
+         SVGASetFenceGoal(fence);
+         SVGA_ClearIRQ();
 
-      /*
-       * Must check again, in case we reached the fence between the
-       * first HasFencePassed and when we set up the IRQ.
-       *
-       * As a small performance optimization, we check yet again after
-       * RingDoorbell, since there's a chance that RingDoorbell will
-       * deschedule this VM and process some SVGA FIFO commands in a
-       * way that appears synchronous from the VM's point of view.
-       */
+         /*
+          * Must check again, in case we reached the fence between the
+          * first HasFencePassed and when we set up the IRQ.
+          *
+          * As a small performance optimization, we check yet again
+          * after RingDoorbell, since there's a chance that RingDoorbell
+          * will deschedule this VM and process some SVGA FIFO commands
+          * in a way that appears synchronous from the VM's point of
+          * view.
+          */
+
+         if (SVGA_HasFencePassed(fence)) {
+            break;
+         }
 
-      if (!SVGA_HasFencePassed(fence)) {
          /*
           * We're about to go to sleep. Make sure the host is awake.
           */
          SVGA_RingDoorbell();
 
-         if (!SVGA_HasFencePassed(fence)) {
-            SVGA_WaitForIRQ();
+         if (SVGA_HasFencePassed(fence)) {
+            break;
          }
+
+         /*
+          * We can be woken by other interrupts, or by a FENCE_GOAL
+          * interrupt for some other goal. Keep waiting until our own
+          * fence has actually passed.
+          */
+         SVGA_WaitForIRQ();
       }
 
-      SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+      /*
+       * Once the host passes the goal, later fences can re-trigger
+       * it. Once nobody is waiting for those, don't pay for the
+       * interrupts.
+       */
+      if (--gSVGA.irq.fenceWaiters == 0) {
+         SVGASetIRQMask(gSVGA.irq.mask & ~SVGA_IRQFLAG_FENCE_GOAL);
+      }
 
    } else
 #endif // REALLY_TINY
@@ -1138,6 +1285,23 @@ SVGA_SyncToFence(uint32 fence)  // IN
       SVGA_WriteReg(SVGA_REG_SYNC, 1);
 
       while (!SVGA_HasFencePassed(fence) && busy) {
+         uint32 spin;
+
+         /*
+          * Each BUSY read is a VM exit. The host keeps processing the
+          * FIFO on its own after a SYNC, so poll the fence in FIFO
+          * memory for a little while before paying for another read.
+          */
+         for (spin = SVGA_FENCE_POLL_SPINS; spin; spin--) {
+            asm volatile ("pause");
+            if (SVGA_HasFencePassed(fence)) {
+               break;
+            }
+         }
+         if (spin) {
+            break;
+         }
+
          busy = (SVGA_ReadReg(SVGA_REG_BUSY) != 0);
       }
    }
@@ -1285,9 +1449,9 @@ SVGA_RingDoorbell(void)
  *
  * SVGA_ClearIRQ --
  *
- *      Clear all pending IRQs. Any IRQs which occurred prior to this
- *      function call will be ignored by the next SVGA_WaitForIRQ()
- *      call.
+ *      Clear all of the current task's pending IRQs. Any IRQs which
+ *      occurred prior to this function call will be ignored by its
+ *      next SVGA_WaitForIRQ() call. Other tasks are unaffected.
  *
  *      Does not affect the current IRQ mask. This function is not
  *      useful unless the SVGA device has IRQ support.
@@ -1306,11 +1470,51 @@ uint32
 SVGA_ClearIRQ(void)
 {
    uint32 flags = 0;
-   Atomic_Exchange(gSVGA.irq.pending, flags);
+   Atomic_Exchange(gTaskCurrent->events, flags);
    return flags;
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGASetIRQMask --
+ *
+ *      Set the device's IRQ mask, skipping the register write (and
+ *      its VM exits) if the mask is already set to this value.
+ *
+ *      IRQMASK is the only register we cache. It's the only one we
+ *      write on every wait. The rest are either written once at
+ *      mode set, or are commands (SYNC, GMR_ID, GMR_DESCRIPTOR) which
+ *      have to reach the device even if the value is unchanged.
+ *
+ *      All writes to SVGA_REG_IRQMASK must go through here, or the
+ *      cached value will be stale.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write SVGA_REG_IRQMASK.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+#ifndef REALLY_TINY
+static void
+SVGASetIRQMask(uint32 mask)  // IN
+{
+   if (mask == gSVGA.irq.mask) {
+      gSVGA.regs.skipped++;
+      return;
+   }
+
+   gSVGA.irq.mask = mask;
+   SVGA_WriteReg(SVGA_REG_IRQMASK, mask);
+}
+#endif
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1326,93 +1530,186 @@ SVGA_ClearIRQ(void)
  *      happen while this function is running, or it could happen
  *      after we decide to sleep.
  *
- *      In this example:
- *
- *        1. If the IRQ occurred before this function was called,
- *           the bit will already be set in irq.pending. We can return.
- *
- *        2. If the IRQ occurs while this function is executing, we
- *           ask our IRQ handler to do a light-weight context switch
- *           back to the beginning of this function, so we can
- *           re-examine irq.pending before sleeping.
+ *      In this example, the ISR posts IRQ flags to every task's event
+ *      bits, and we block the current task until one of its bits is
+ *      set. See Task_WaitIRQ for details. Other tasks run while we
+ *      wait, and the CPU halts when none of them can.
  *
- *        3. If the IRQ occurs while we're sleeping, we wake up
- *           from the HLT instruction and re-test irq.pending.
+ *      After waking, we run the bottom half, if one is installed.
  *
  * Results:
  *      Returns a mask of all the interrupt flags that were set prior
  *      to the clear. This will always be nonzero.
  *
  * Side effects:
- *      Clears the irq.pending flags for exactly the set of IRQs we return.
+ *      Clears the current task's pending flags for exactly the set of
+ *      IRQs we return. Interrupts are enabled while we wait, and
+ *      restored to the caller's state before we return.
  *
  *-----------------------------------------------------------------------------
  */
 
-static __attribute__ ((noinline)) uint32
-SVGAWaitForIRQInternal(void *arg, ...)
+#ifndef REALLY_TINY
+uint32
+SVGA_WaitForIRQ(void)
 {
-   uint32 flags = 0;
+   uint32 flags = Task_WaitIRQ(~0);
 
-   /*
-    * switchContext must be set to TRUE before we halt, or we'll deadlock.
-    * This variable is marked as volatile, plus we use a compiler memory barrier.
-    */
-   gSVGA.irq.switchContext = TRUE;
-   asm volatile ("" ::: "memory");
+   if (gSVGA.irq.bottomHalf) {
+      gSVGA.irq.bottomHalf();
+   }
 
-   Atomic_Exchange(gSVGA.irq.pending, flags);
+   return flags;
+}
 
-   if (!flags) {
-      Intr_Halt();
-   }
 
-   /*
-    * Must set switchContext to FALSE before this stack frame is deallocated.
-    */
-   gSVGA.irq.switchContext = FALSE;
-   asm volatile ("" ::: "memory");
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGAIRQPending --
+ *
+ *      Task_Wait() callback for Task_WaitIRQ.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   return flags;
+typedef struct SVGAIRQWait {
+   Task   *task;
+   uint32  mask;
+} SVGAIRQWait;
+
+static Bool
+SVGAIRQPending(void *arg)  // IN
+{
+   SVGAIRQWait *wait = arg;
+   return (wait->task->events & wait->mask) != 0;
 }
 
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Task_WaitIRQ --
+ *
+ *      Block the current task until any of the SVGA IRQs in 'mask' are
+ *      pending for it. IRQs which occurred since the task's last
+ *      SVGA_ClearIRQ() count, so there's no race between checking
+ *      for some condition and waiting for the IRQ that signals it.
+ *
+ *      Each task has its own pending flags, so any number of tasks
+ *      can wait at once without consuming each other's IRQs. This
+ *      doesn't change the device's IRQ mask; the caller must unmask
+ *      the IRQs it waits for.
+ *
+ * Results:
+ *      Returns the pending flags in 'mask'. Always nonzero.
+ *
+ * Side effects:
+ *      Clears the returned flags. Updates the wakeup latency stats if
+ *      we had to block. Interrupts are enabled while we wait, and
+ *      restored to the caller's state before we return.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
 uint32
-SVGA_WaitForIRQ(void)
+Task_WaitIRQ(uint32 mask)  // IN
 {
+   Bool intrFlag = Intr_Save();
+   SVGAIRQWait wait = { gTaskCurrent, mask };
+   Bool blocked = !SVGAIRQPending(&wait);
    uint32 flags;
 
+   if (blocked) {
+      Task_Wait(SVGAIRQPending, &wait);
+   }
+
    /*
-    * Store this CPU context, and tell the IRQ handler to return
-    * here if an IRQ occurs. We use IntrContext here just like a
-    * setjmp/longjmp that works in ISRs.
-    *
-    * This must be above the irq.pending check, so that we re-test
-    * irq.pending if an IRQ occurs after testing irq.pending but
-    * before we halt. Without this, we could deadlock if an IRQ
-    * comes in before we actually halt but after we've decided to
-    * halt.
+    * With interrupts disabled, the ISR can't be setting our flags or
+    * be halfway through updating lastTSC.
     */
 
-   Intr_SaveContext((IntrContext*) &gSVGA.irq.newContext);
+   Intr_Disable();
+   flags = wait.task->events & mask;
+   wait.task->events &= ~flags;
 
-   do {
-      /*
-       * XXX: The arguments here are a kludge to prevent the interrupt
-       *      stack frame from overlapping the stack frame referenced
-       *      by Intr_SaveContext().
-       *
-       *      Be sure to look at the generated assembly and compare the
-       *      size of this argument list to the amount of stack space
-       *      allocated for Intr_SaveContext.
-       */
-      flags = SVGAWaitForIRQInternal(NULL, NULL, NULL, NULL, NULL, NULL);
+   if (blocked) {
+      volatile SVGAWakeStats *stats = gTaskPollIdle ? &gSVGA.irq.pollWake
+                                                    : &gSVGA.irq.haltWake;
+      uint32 latency = Timer_GetTSC() - gSVGA.irq.lastTSC;
 
-   } while (flags == 0);
+      stats->cycles += latency;
+      stats->count++;
+      if (latency > stats->max) {
+         stats->max = latency;
+      }
+   }
+
+   Intr_Restore(intrFlag);
 
    return flags;
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Task_WaitFence --
+ *
+ *      Block the current task until 'fence' has passed, letting other
+ *      tasks run in the meantime.
+ *
+ *      This is SVGA_SyncToFence, which only blocks the calling task
+ *      when the host supports FENCE_GOAL interrupts. On older hosts it
+ *      falls back on a legacy sync, which stalls every task.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See SVGA_SyncToFence.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+Task_WaitFence(uint32 fence)  // IN
+{
+   SVGA_SyncToFence(fence);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_SetBottomHalf --
+ *
+ *      Install a function to run with interrupts enabled every time
+ *      SVGA_WaitForIRQ wakes up. This is a place to handle deferred
+ *      work that an interrupt made possible, like retiring buffers
+ *      once their fences pass, without doing it inside the ISR.
+ *
+ *      SVGA_WaitForIRQ can be called while we're in the middle of
+ *      reserving FIFO space, so the bottom half must not write to the
+ *      FIFO or wait for the SVGA device.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces any previous bottom half.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_SetBottomHalf(SVGABottomHalfFn fn)  // IN (optional)
+{
+   gSVGA.irq.bottomHalf = fn;
+}
+#endif
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1421,22 +1718,17 @@ SVGA_WaitForIRQ(void)
  *      This is the ISR for the SVGA device's interrupt. We ask the
  *      SVGA device which interrupt occurred, and clear its flag.
  *
- *      To report this IRQ to the rest of the driver, we:
- *
- *        1. Atomically remember the IRQ in the irq.pending bitmask.
- *
- *        2. Optionally switch to a different light-weight thread
- *           or a different place in this thread upon returning.
- *           This is analogous to waking up a sleeping thread in
- *           a driver for a real operating system. See SVGA_WaitForIRQ
- *           for details.
+ *      To report this IRQ to the rest of the driver, we atomically
+ *      set its flags in every task's event bits. If the CPU is halted,
+ *      returning from this interrupt wakes it up, and the scheduler
+ *      notices the new bits. See Task_WaitIRQ for details.
  *
  * Results:
  *      void.
  *
  * Side effects:
- *      Sets bits in pendingIRQs. Reads and clears the device's IRQ flags.
- *      May switch execution contexts.
+ *      Signals all tasks. Reads and clears the device's IRQ flags.
+ *      Timestamps the IRQ, for measuring wakeup latency.
  *
  *-----------------------------------------------------------------------------
  */
@@ -1445,8 +1737,6 @@ SVGA_WaitForIRQ(void)
 void
 SVGAInterruptHandler(int vector)  // IN (unused)
 {
-   IntrContext *context = Intr_GetContext(vector);
-
    /*
     * The SVGA_IRQSTATUS_PORT is a separate I/O port, not a register.
     * Reading from it gives us the set of IRQ flags which are
@@ -1461,39 +1751,256 @@ SVGAInterruptHandler(int vector)  // IN (unused)
    IO_Out32(port, irqFlags);
 
    gSVGA.irq.count++;
+   gSVGA.irq.lastTSC = Timer_GetTSC();
+   gSVGA.irq.lastFence = gSVGA.fifoMem[SVGA_FIFO_FENCE];
 
    if (!irqFlags) {
       SVGA_Panic("Spurious SVGA IRQ");
    }
 
-   Atomic_Or(gSVGA.irq.pending, irqFlags);
+   Task_Signal(irqFlags);
+}
+#endif
+
+
+/*
+ * VRAM allocator.
+ *
+ * The framebuffer GMR is carved into a table of blocks, sorted by
+ * offset, which together cover all of VRAM. Allocation is first-fit,
+ * so the first allocation is always at offset 0. Freed blocks are
+ * merged with free neighbours.
+ */
+
+typedef struct SVGAVRAMBlock {
+   uint32 offset;
+   uint32 size;
+   Bool   used;
+} SVGAVRAMBlock;
+
+static struct {
+   uint32          numBlocks;
+   SVGAVRAMBlock   blocks[SVGA_VRAM_MAX_BLOCKS];
+   uint32          failures;
+   uint32          reserved;   // Size of SVGA_ReserveVRAM's block, if any
+   SVGAMemCounter  bytes;
+} gVRAM;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGAVRAMInit --
+ *
+ *      Start out with a single free block covering all of VRAM.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGAVRAMInit(void)
+{
+   if (!gVRAM.numBlocks) {
+      gVRAM.numBlocks = 1;
+      gVRAM.blocks[0].offset = 0;
+      gVRAM.blocks[0].size = gSVGA.vramSize ? gSVGA.vramSize : gSVGA.fbSize;
+      gVRAM.blocks[0].used = FALSE;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGAVRAMSplit --
+ *
+ *      Split block 'i' in two, so that the first piece is 'size'
+ *      bytes long.
+ *
+ * Results:
+ *      FALSE if the block table is full.
+ *
+ * Side effects:
+ *      Shifts later blocks up by one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+SVGAVRAMSplit(uint32 i,     // IN
+              uint32 size)  // IN
+{
+   uint32 j;
 
-   if (gSVGA.irq.switchContext) {
-      memcpy((void*) &gSVGA.irq.oldContext, context, sizeof *context);
-      memcpy(context, (void*) &gSVGA.irq.newContext, sizeof *context);
-      gSVGA.irq.switchContext = FALSE;
+   if (gVRAM.numBlocks == SVGA_VRAM_MAX_BLOCKS) {
+      return FALSE;
    }
+
+   for (j = gVRAM.numBlocks; j > i + 1; j--) {
+      gVRAM.blocks[j] = gVRAM.blocks[j - 1];
+   }
+   gVRAM.numBlocks++;
+
+   gVRAM.blocks[i + 1].offset = gVRAM.blocks[i].offset + size;
+   gVRAM.blocks[i + 1].size = gVRAM.blocks[i].size - size;
+   gVRAM.blocks[i + 1].used = gVRAM.blocks[i].used;
+   gVRAM.blocks[i].size = size;
+
+   return TRUE;
 }
-#endif
 
 
 /*
  *----------------------------------------------------------------------
  *
- * SVGA_AllocGMR --
+ * SVGAVRAMRemove --
+ *
+ *      Delete block 'i' from the table, after its memory has been
+ *      given to a neighbour.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Shifts later blocks down by one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGAVRAMRemove(uint32 i)  // IN
+{
+   gVRAM.numBlocks--;
+   for (; i < gVRAM.numBlocks; i++) {
+      gVRAM.blocks[i] = gVRAM.blocks[i + 1];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGAVRAMMerge --
+ *
+ *      If blocks 'i' and 'i+1' are both free, merge them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May remove a block from the table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGAVRAMMerge(uint32 i)  // IN
+{
+   if (i + 1 >= gVRAM.numBlocks ||
+       gVRAM.blocks[i].used || gVRAM.blocks[i + 1].used) {
+      return;
+   }
+
+   gVRAM.blocks[i].size += gVRAM.blocks[i + 1].size;
+   SVGAVRAMRemove(i + 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA_TryAllocGMR --
  *
  *      Allocate a buffer from the framebuffer GMR for screen/DMA operations.
  *      Returns both a pointer (for us to use) and an SVGAGuestPtr (for the
- *      SVGA device to use).
+ *      SVGA device to use). The offset is a multiple of 'alignment',
+ *      which must be a power of two.
  *
- *      XXX: This is a trivial implementation which just returns
- *           consecutive addresses in the framebuffer.
+ * Results:
+ *      Returns a local pointer and an SVGAGuestPtr to unused memory,
+ *      or NULL if there isn't a large enough free block of VRAM.
+ *
+ * Side effects:
+ *      Allocates memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+SVGA_TryAllocGMR(uint32 size,        // IN
+                 uint32 alignment,   // IN
+                 SVGAGuestPtr *ptr)  // OUT
+{
+   uint32 i;
+
+   SVGAVRAMInit();
+
+   if (alignment < SVGA_VRAM_MIN_ALIGN) {
+      alignment = SVGA_VRAM_MIN_ALIGN;
+   }
+   size = (size + SVGA_VRAM_MIN_ALIGN - 1) & ~(SVGA_VRAM_MIN_ALIGN - 1);
+   if (!size) {
+      size = SVGA_VRAM_MIN_ALIGN;
+   }
+
+   for (i = 0; i < gVRAM.numBlocks; i++) {
+      SVGAVRAMBlock *block = &gVRAM.blocks[i];
+      uint32 pad = ((block->offset + alignment - 1) & ~(alignment - 1)) - block->offset;
+
+      if (block->used || block->size < pad || block->size - pad < size) {
+         continue;
+      }
+
+      /*
+       * If the block table is full, only a block that needs no
+       * splitting will do, so keep looking for one.
+       */
+      if (pad) {
+         if (!SVGAVRAMSplit(i, pad)) {
+            continue;
+         }
+         i++;
+      }
+      if (gVRAM.blocks[i].size > size && !SVGAVRAMSplit(i, size)) {
+         if (pad) {
+            /* Undo the pad split, and resume scanning after this block. */
+            SVGAVRAMMerge(i - 1);
+            i--;
+         }
+         continue;
+      }
+
+      gVRAM.blocks[i].used = TRUE;
+      SVGA_CountAlloc(&gVRAM.bytes, gVRAM.blocks[i].size);
+      ptr->gmrId = SVGA_GMR_FRAMEBUFFER;
+      ptr->offset = gVRAM.blocks[i].offset;
+      return gSVGA.fbMem + ptr->offset;
+   }
+
+   gVRAM.failures++;
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA_AllocGMR --
+ *
+ *      Like SVGA_TryAllocGMR, with the minimum alignment. Running out
+ *      of VRAM is fatal.
  *
  * Results:
  *      Returns a local pointer and an SVGAGuestPtr to unused memory.
  *
  * Side effects:
- *      Allocates memory.
+ *      Allocates memory. Panics if VRAM is full.
  *
  *----------------------------------------------------------------------
  */
@@ -1502,10 +2009,185 @@ void *
 SVGA_AllocGMR(uint32 size,        // IN
               SVGAGuestPtr *ptr)  // OUT
 {
-   static SVGAGuestPtr nextPtr = { SVGA_GMR_FRAMEBUFFER, 0 };
-   *ptr = nextPtr;
-   nextPtr.offset += size;
-   return gSVGA.fbMem + ptr->offset;
+   void *result = SVGA_TryAllocGMR(size, SVGA_VRAM_MIN_ALIGN, ptr);
+
+   if (!result) {
+      SVGA_Panic("Out of VRAM.");
+   }
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA_FreeGMR --
+ *
+ *      Free a buffer returned by SVGA_AllocGMR or SVGA_TryAllocGMR.
+ *      The caller must make sure the device is done with it first.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Panics if 'ptr' isn't an allocated buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA_FreeGMR(const SVGAGuestPtr *ptr)  // IN
+{
+   uint32 i;
+
+   for (i = 0; i < gVRAM.numBlocks; i++) {
+      if (gVRAM.blocks[i].offset == ptr->offset) {
+         break;
+      }
+   }
+
+   if (ptr->gmrId != SVGA_GMR_FRAMEBUFFER || i == gVRAM.numBlocks ||
+       !gVRAM.blocks[i].used) {
+      SVGA_Panic("SVGA_FreeGMR: Bad pointer, or already freed.");
+   }
+   if (i == 0 && gVRAM.reserved) {
+      SVGA_Panic("SVGA_FreeGMR: Can't free reserved VRAM.");
+   }
+
+   gVRAM.blocks[i].used = FALSE;
+   SVGA_CountFree(&gVRAM.bytes, gVRAM.blocks[i].size);
+   SVGAVRAMMerge(i);
+   if (i > 0) {
+      SVGAVRAMMerge(i - 1);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA_ReserveVRAM --
+ *
+ *      Make sure that at least the first 'size' bytes of VRAM are
+ *      allocated, as a single block at offset 0. This is for memory
+ *      that lives at a fixed place, like the legacy framebuffer or
+ *      Screen Object backing stores. Calling this repeatedly only
+ *      grows the reservation, so it doesn't leak.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Panics if other allocations are in the way, including an
+ *      ordinary allocation that already got offset 0.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA_ReserveVRAM(uint32 size)  // IN
+{
+   SVGAVRAMBlock *first = &gVRAM.blocks[0];
+
+   SVGAVRAMInit();
+   size = (size + SVGA_VRAM_MIN_ALIGN - 1) & ~(SVGA_VRAM_MIN_ALIGN - 1);
+
+   if (gVRAM.reserved) {
+      uint32 oldSize = first->size;
+
+      /*
+       * Grow the existing reservation into the free block after it.
+       */
+      while (first->size < size) {
+         SVGAVRAMBlock *next = &gVRAM.blocks[1];
+
+         if (gVRAM.numBlocks < 2 || next->used ||
+             first->size + next->size < size) {
+            SVGA_Panic("SVGA_ReserveVRAM: VRAM after the reservation is in use.");
+         }
+         if (first->size + next->size > size &&
+             !SVGAVRAMSplit(1, size - first->size)) {
+            SVGA_Panic("SVGA_ReserveVRAM: Too many VRAM blocks.");
+         }
+         first->size += next->size;
+         SVGAVRAMRemove(1);
+      }
+
+      /* Growing the reservation counts as an allocation. */
+      if (first->size > oldSize) {
+         SVGA_CountAlloc(&gVRAM.bytes, first->size - oldSize);
+      }
+
+   } else {
+      if (first->used) {
+         SVGA_Panic("SVGA_ReserveVRAM: VRAM at offset 0 is already allocated.");
+      }
+      if (first->size < size) {
+         SVGA_Panic("SVGA_ReserveVRAM: Not enough free VRAM at offset 0.");
+      }
+      if (first->size > size && !SVGAVRAMSplit(0, size)) {
+         SVGA_Panic("SVGA_ReserveVRAM: Too many VRAM blocks.");
+      }
+      first->used = TRUE;
+      SVGA_CountAlloc(&gVRAM.bytes, first->size);
+   }
+
+   gVRAM.reserved = first->size;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA_GetVRAMStats --
+ *
+ *      Summarize VRAM usage. The largest free block, compared to the
+ *      total free space, shows how fragmented VRAM is.
+ *      stats->bytes has the peak usage and allocation counts since
+ *      boot, including SVGA_ReserveVRAM.
+ *
+ * Results:
+ *      Fills in 'stats'.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA_GetVRAMStats(SVGAVRAMStats *stats)  // OUT
+{
+   uint32 i;
+
+   memset(stats, 0, sizeof *stats);
+   stats->totalBytes = gSVGA.vramSize ? gSVGA.vramSize : gSVGA.fbSize;
+   stats->freeBytes = stats->totalBytes;
+   stats->largestFree = stats->totalBytes;
+   stats->failures = gVRAM.failures;
+   stats->bytes = gVRAM.bytes;
+
+   if (!gVRAM.numBlocks) {
+      return;
+   }
+
+   stats->freeBytes = 0;
+   stats->largestFree = 0;
+
+   for (i = 0; i < gVRAM.numBlocks; i++) {
+      SVGAVRAMBlock *block = &gVRAM.blocks[i];
+
+      if (block->used) {
+         stats->usedBytes += block->size;
+         stats->numAllocs++;
+      } else {
+         stats->freeBytes += block->size;
+         stats->numFreeBlocks++;
+         if (block->size > stats->largestFree) {
+            stats->largestFree = block->size;
+         }
+      }
+   }
 }
 
 
@@ -46,6 +46,68 @@
 #include "svga_overlay.h"
 #include "svga3d_reg.h"
 
+typedef void (*SVGABottomHalfFn)(void);
+typedef void (*SVGAPanicFn)(void);
+
+/*
+ * IRQ-to-wakeup latency, in TSC cycles.
+ */
+
+typedef struct SVGAWakeStats {
+   uint64 cycles;
+   uint32 count;
+   uint32 max;
+} SVGAWakeStats;
+
+/*
+ * Memory accounting. Each allocator keeps a counter per kind of
+ * resource it hands out, in whatever unit is natural for it: bytes,
+ * pages or IDs. lib/util/memstats.h collects them into one report.
+ */
+
+typedef struct SVGAMemCounter {
+   uint32 current;
+   uint32 peak;
+   uint32 allocs;
+   uint32 frees;
+} SVGAMemCounter;
+
+static inline void
+SVGA_CountAlloc(SVGAMemCounter *counter, uint32 amount)
+{
+   counter->current += amount;
+   counter->allocs++;
+   if (counter->current > counter->peak) {
+      counter->peak = counter->current;
+   }
+}
+
+static inline void
+SVGA_CountFree(SVGAMemCounter *counter, uint32 amount)
+{
+   counter->current -= amount;
+   counter->frees++;
+}
+
+/*
+ * VRAM allocator limits and statistics. Buffers allocated from the
+ * framebuffer GMR are at least 16-byte aligned.
+ */
+
+#define SVGA_VRAM_MAX_BLOCKS  256
+#define SVGA_VRAM_MIN_ALIGN   16
+
+typedef struct SVGAVRAMStats {
+   uint32 totalBytes;
+   uint32 usedBytes;
+   uint32 freeBytes;
+   uint32 largestFree;     // Largest single free block
+   uint32 numAllocs;
+   uint32 numFreeBlocks;
+   uint32 failures;        // Allocations that didn't fit
+   SVGAMemCounter bytes;   // Allocated bytes, including alignment padding
+} SVGAVRAMStats;
+
 typedef struct SVGADevice {
    PCIAddress pciAddr;
    uint32     ioBase;
@@ -68,14 +130,67 @@ typedef struct SVGADevice {
       Bool    usingBounceBuffer;
       uint8   bounceBuffer[1024 * 1024];
       uint32  nextFence;
+
+      /* Running total of committed bytes. Wraps around. */
+      uint32  bytesCommitted;
+
+      /* Time spent blocked in SVGAFIFOFull, in TSC cycles. */
+      uint64  fullCycles;
+      uint32  fullCount;
+
+      /* Largest reservation, and how many went through the bounce buffer. */
+      uint32  peakReserved;
+      uint32  bounceCount;
    } fifo;
 
+#ifndef REALLY_TINY
+   /*
+    * Every register access is a pair of port I/Os, and every port
+    * I/O is a VM exit. Keep per-register access counts so apps can
+    * see where their exits are going. Registers above SVGA_REG_TOP
+    * (scratch and palette) share the last slot.
+    */
+   struct {
+      uint32  reads[SVGA_REG_TOP + 1];
+      uint32  writes[SVGA_REG_TOP + 1];
+      uint32  total;
+      uint32  skipped;   // Writes avoided because the value was cached
+   } regs;
+#endif
+
    volatile struct {
-      uint32        pending;
-      uint32        switchContext;
-      IntrContext   oldContext;
-      IntrContext   newContext;
+      uint32        mask;      // Cached value of SVGA_REG_IRQMASK
       uint32        count;
+
+      /*
+       * Pending IRQ flags live in each task's event bits, so every
+       * task sees every IRQ. See Task_WaitIRQ(). Tasks waiting on
+       * different fences share the single FENCE_GOAL register, so
+       * we count them, and leave FENCE_GOAL unmasked until the last
+       * one is done.
+       */
+      uint32        fenceWaiters;
+
+      /*
+       * IRQ-to-wakeup latency. The ISR timestamps each interrupt, and
+       * Task_WaitIRQ measures how long it took the waiting task to
+       * resume after blocking. If gTaskPollIdle is set, the scheduler
+       * spins with interrupts enabled instead of halting. That's the
+       * fastest any wait could notice an IRQ, so it's the baseline
+       * to compare the halt path against. The ISR also records the
+       * latest fence along with its timestamp, which gives profilers
+       * a tighter bound on when a fence passed than polling does.
+       */
+      uint64        lastTSC;
+      uint32        lastFence;  // SVGA_FIFO_FENCE as of lastTSC
+      SVGAWakeStats haltWake;
+      SVGAWakeStats pollWake;
+
+      /*
+       * Optional deferred work, run by SVGA_WaitForIRQ each time it
+       * wakes up. See SVGA_SetBottomHalf().
+       */
+      SVGABottomHalfFn bottomHalf;
    } irq;
 
 } SVGADevice;
@@ -87,12 +202,19 @@ void SVGA_Enable(void);
 void SVGA_SetMode(uint32 width, uint32 height, uint32 bpp);
 void SVGA_Disable(void);
 void SVGA_Panic(const char *err);
+void SVGA_SetPanicHook(SVGAPanicFn fn);
 void SVGA_DefaultFaultHandler(int vector);
 
 uint32 SVGA_ReadReg(uint32 index);
 void SVGA_WriteReg(uint32 index, uint32 value);
 uint32 SVGA_ClearIRQ(void);
 uint32 SVGA_WaitForIRQ();
+void SVGA_SetBottomHalf(SVGABottomHalfFn fn);
+
+/* Blocking primitives for tasks (see task.h) */
+
+uint32 Task_WaitIRQ(uint32 mask);
+void Task_WaitFence(uint32 fence);
 
 Bool SVGA_IsFIFORegValid(int reg);
 Bool SVGA_HasFIFOCap(int cap);
@@ -109,6 +231,10 @@ Bool SVGA_HasFencePassed(uint32 fence);
 void SVGA_RingDoorbell(void);
 
 void * SVGA_AllocGMR(uint32 size, SVGAGuestPtr *ptr);
+void * SVGA_TryAllocGMR(uint32 size, uint32 alignment, SVGAGuestPtr *ptr);
+void SVGA_FreeGMR(const SVGAGuestPtr *ptr);
+void SVGA_ReserveVRAM(uint32 size);
+void SVGA_GetVRAMStats(SVGAVRAMStats *stats);
 
 /* 2D commands */
 
@@ -320,6 +320,67 @@ SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage *guestImage,     // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3D_BeginSurfaceDMAWithSuffix --
+ *
+ *      Like SVGA3D_BeginSurfaceDMA, but the command is followed by an
+ *      SVGA3dCmdSurfaceDMASuffix. The suffix lets the guest bound the
+ *      region of the guest buffer that the host may touch, and give
+ *      the host hints about the transfer:
+ *
+ *        - 'discard' says that the rest of the destination image is
+ *          no longer needed. The host may give the surface new
+ *          storage instead of waiting for pending reads.
+ *
+ *        - 'unsynchronized' says that the transfer doesn't overlap
+ *          anything pending commands still read, so the host needn't
+ *          wait for them.
+ *
+ *      These are only hints. Hosts which don't know about the suffix
+ *      ignore it: it's shorter than a copy box, so it doesn't change
+ *      the number of boxes they see.
+ *
+ *      The suffix is initialized with no flags and no offset limit.
+ *
+ * Results:
+ *      Returns pointers to a box array and a suffix allocated in the
+ *      FIFO.
+ *
+ * Side effects:
+ *      Begins a FIFO reservation.
+ *      Begins a FIFO command which will eventually perform DMA.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3D_BeginSurfaceDMAWithSuffix(SVGA3dGuestImage *guestImage,         // IN
+                                 SVGA3dSurfaceImageId *hostImage,      // IN
+                                 SVGA3dTransferType transfer,          // IN
+                                 SVGA3dCopyBox **boxes,                // OUT
+                                 uint32 numBoxes,                      // IN
+                                 SVGA3dCmdSurfaceDMASuffix **suffix)   // OUT
+{
+   SVGA3dCmdSurfaceDMA *cmd;
+   uint32 boxesSize = sizeof **boxes * numBoxes;
+
+   cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SURFACE_DMA,
+                            sizeof *cmd + boxesSize + sizeof **suffix);
+
+   cmd->guest = *guestImage;
+   cmd->host = *hostImage;
+   cmd->transfer = transfer;
+   *boxes = (SVGA3dCopyBox*) &cmd[1];
+   *suffix = (SVGA3dCmdSurfaceDMASuffix*) &(*boxes)[numBoxes];
+
+   memset(*boxes, 0, boxesSize + sizeof **suffix);
+   (*suffix)->suffixSize = sizeof **suffix;
+   (*suffix)->maximumOffset = 0xFFFFFFFF;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
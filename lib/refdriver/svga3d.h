@@ -72,6 +72,12 @@ void SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage *guestImage,
                             SVGA3dTransferType transfer,
                             SVGA3dCopyBox **boxes,
                             uint32 numBoxes);
+void SVGA3D_BeginSurfaceDMAWithSuffix(SVGA3dGuestImage *guestImage,
+                                      SVGA3dSurfaceImageId *hostImage,
+                                      SVGA3dTransferType transfer,
+                                      SVGA3dCopyBox **boxes,
+                                      uint32 numBoxes,
+                                      SVGA3dCmdSurfaceDMASuffix **suffix);
 
 
 /*
@@ -0,0 +1,326 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * fenceprof.c --
+ *
+ *      Host timeline profiler, built on timestamped fences. See
+ *      fenceprof.h for an overview.
+ */
+
+#include "fenceprof.h"
+#include "timer.h"
+#include "intr.h"
+#include "console.h"
+#include "vmbackdoor.h"
+
+FenceProfState gFenceProf;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProfFindRange --
+ *
+ *      Look up a range by name, creating it if necessary. Names are
+ *      compared by value, so string literals from different modules
+ *      refer to the same range.
+ *
+ * Results:
+ *      Index into gFenceProf.ranges.
+ *
+ * Side effects:
+ *      Panics if there are too many distinct ranges.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+FenceProfFindRange(const char *name)  // IN
+{
+   uint32 i;
+
+   for (i = 0; i < gFenceProf.numRanges; i++) {
+      const char *a = gFenceProf.ranges[i].name;
+      const char *b = name;
+
+      while (*a && *a == *b) {
+         a++;
+         b++;
+      }
+      if (*a == *b) {
+         return i;
+      }
+   }
+
+   if (gFenceProf.numRanges == FENCEPROF_MAX_RANGES) {
+      SVGA_Panic("Too many FenceProf ranges");
+   }
+
+   gFenceProf.ranges[i].name = name;
+   return gFenceProf.numRanges++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProf_Init --
+ *
+ *      Reset the profiler. Must be called after SVGA_Init.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Asks the host for the TSC frequency.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FenceProf_Init(void)
+{
+   memset(&gFenceProf, 0, sizeof gFenceProf);
+
+   gFenceProf.mhz = VMBackdoor_GetMHz();
+   if (!gFenceProf.mhz) {
+      gFenceProf.mhz = 1;
+   }
+
+   gFenceProf.lastPassTSC = gFenceProf.lastInsertTSC = Timer_GetTSC();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProf_Poll --
+ *
+ *      Retire all marks the host has passed, in order, and charge
+ *      each one's host time to its range.
+ *
+ *      This is safe to call from interrupt handlers, for example from
+ *      a timer to get a finer-grained timeline.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FenceProf_Poll(void)
+{
+   Bool intrFlag = Intr_Save();
+   uint64 now = Timer_GetTSC();
+
+   Intr_Disable();
+
+   while (gFenceProf.count) {
+      FenceProfMark *mark = &gFenceProf.marks[(gFenceProf.head + FENCEPROF_MAX_MARKS
+                                               - gFenceProf.count) % FENCEPROF_MAX_MARKS];
+      uint64 passTSC = now;
+      uint64 startTSC = MAX(gFenceProf.lastPassTSC, gFenceProf.lastInsertTSC);
+
+      if (!SVGA_HasFencePassed(mark->fence)) {
+         break;
+      }
+
+      /*
+       * If an SVGA interrupt arrived after this fence passed, its
+       * timestamp is a tighter bound than 'now'.
+       */
+      if ((int32)(gSVGA.irq.lastFence - mark->fence) >= 0 &&
+          gSVGA.irq.lastTSC >= MAX(startTSC, mark->insertTSC) &&
+          gSVGA.irq.lastTSC < passTSC) {
+         passTSC = gSVGA.irq.lastTSC;
+      }
+
+      if (passTSC > startTSC) {
+         gFenceProf.ranges[mark->range].cycles += passTSC - startTSC;
+      }
+      gFenceProf.ranges[mark->range].count++;
+
+      if (mark->frameEnd) {
+         gFenceProf.frames++;
+      }
+
+      gFenceProf.lastPassTSC = passTSC;
+      gFenceProf.lastInsertTSC = mark->insertTSC;
+      gFenceProf.count--;
+   }
+
+   Intr_Restore(intrFlag);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProf_Mark --
+ *
+ *      End the current range of commands, and attribute them to
+ *      'rangeName'. The next range starts immediately afterwards.
+ *
+ * Results:
+ *      Returns the fence we inserted.
+ *
+ * Side effects:
+ *      Writes to the FIFO. If too many marks are outstanding, waits
+ *      for the oldest one.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+FenceProf_Mark(const char *rangeName)  // IN
+{
+   FenceProfMark *mark;
+   uint32 range, fence;
+   uint64 insertTSC;
+   Bool intrFlag;
+
+   FenceProf_Poll();
+
+   if (gFenceProf.count == FENCEPROF_MAX_MARKS) {
+      SVGA_SyncToFence(gFenceProf.marks[gFenceProf.head].fence);
+      FenceProf_Poll();
+   }
+
+   /*
+    * InsertFence may wait for FIFO space, so it must run with
+    * interrupts enabled. An interrupt-time Poll can't see the mark
+    * until we publish it below.
+    */
+
+   range = FenceProfFindRange(rangeName);
+   fence = SVGA_InsertFence();
+   insertTSC = Timer_GetTSC();
+
+   intrFlag = Intr_Save();
+   Intr_Disable();
+
+   mark = &gFenceProf.marks[gFenceProf.head];
+   mark->range = range;
+   mark->frameEnd = FALSE;
+   mark->fence = fence;
+   mark->insertTSC = insertTSC;
+
+   gFenceProf.head = (gFenceProf.head + 1) % FENCEPROF_MAX_MARKS;
+   gFenceProf.count++;
+
+   Intr_Restore(intrFlag);
+
+   return fence;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProf_EndFrame --
+ *
+ *      Mark the end of a frame. Call this after the frame's last
+ *      FenceProf_Mark. FenceProf_Dump reports host time per frame.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FenceProf_EndFrame(void)
+{
+   Bool intrFlag = Intr_Save();
+   Intr_Disable();
+
+   if (gFenceProf.count) {
+      gFenceProf.marks[(gFenceProf.head + FENCEPROF_MAX_MARKS - 1)
+                       % FENCEPROF_MAX_MARKS].frameEnd = TRUE;
+   }
+
+   Intr_Restore(intrFlag);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FenceProf_Dump --
+ *
+ *      Write a per-frame breakdown of host time to the console,
+ *      averaged over all frames retired since the last dump, and
+ *      start a new reporting interval.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the console.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FenceProf_Dump(void)
+{
+   uint64 totalCycles = 0;
+   uint32 frames, i;
+   float scale;
+
+   FenceProf_Poll();
+
+   frames = gFenceProf.frames;
+   if (!frames) {
+      Console_Format("Host time: no frames retired\n");
+      return;
+   }
+
+   scale = 1.0f / ((float)frames * gFenceProf.mhz);
+
+   Console_Format("Host time per frame, over %d frames:\n", frames);
+
+   for (i = 0; i < gFenceProf.numRanges; i++) {
+      FenceProfRange *range = &gFenceProf.ranges[i];
+
+      Console_Format("  %s: %d us, %d marks\n", range->name,
+                     (uint32)((int64)range->cycles * scale), range->count);
+
+      totalCycles += range->cycles;
+      range->cycles = 0;
+      range->count = 0;
+   }
+
+   Console_Format("  total: %d us\n", (uint32)((int64)totalCycles * scale));
+   gFenceProf.frames = 0;
+}
@@ -0,0 +1,91 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * fenceprof.h --
+ *
+ *      Host timeline profiler, built on timestamped fences.
+ *
+ *      The app splits each frame into named ranges of commands (for
+ *      example "clear", "draw", "present") by calling FenceProf_Mark()
+ *      at the end of each range. Each mark is a fence, timestamped
+ *      with the guest TSC when it's inserted and again when we see
+ *      that the host has passed it.
+ *
+ *      The host starts on a range when it finishes the previous one,
+ *      or when the range's first command was submitted, whichever is
+ *      later. It finishes the range when the range's fence passes. The
+ *      difference is our estimate of how long the host spent on it.
+ *
+ *      Fences are observed by polling (every FenceProf call polls),
+ *      and by the SVGA interrupt handler, which timestamps the latest
+ *      fence whenever an IRQ arrives. Estimates are only as precise as
+ *      these observations, so poll often for a finer timeline.
+ */
+
+#ifndef __FENCEPROF_H__
+#define __FENCEPROF_H__
+
+#include "svga.h"
+
+#define FENCEPROF_MAX_RANGES  16
+#define FENCEPROF_MAX_MARKS   64
+
+typedef struct FenceProfRange {
+   const char  *name;
+   uint64       cycles;      // Host cycles in this reporting interval
+   uint32       count;       // Marks retired in this reporting interval
+} FenceProfRange;
+
+typedef struct FenceProfMark {
+   uint32       fence;
+   uint32       range;
+   Bool         frameEnd;
+   uint64       insertTSC;
+} FenceProfMark;
+
+typedef struct FenceProfState {
+   FenceProfRange  ranges[FENCEPROF_MAX_RANGES];
+   uint32          numRanges;
+
+   FenceProfMark   marks[FENCEPROF_MAX_MARKS];
+   uint32          head;
+   uint32          count;
+
+   uint64          lastPassTSC;    // When the last retired mark passed
+   uint64          lastInsertTSC;  // When the last retired mark was inserted
+   uint32          frames;         // Frames retired this reporting interval
+   uint32          mhz;
+} FenceProfState;
+
+extern FenceProfState gFenceProf;
+
+void FenceProf_Init(void);
+uint32 FenceProf_Mark(const char *rangeName);
+void FenceProf_EndFrame(void);
+void FenceProf_Poll(void);
+void FenceProf_Dump(void);
+
+#endif /* __FENCEPROF_H__ */
@@ -0,0 +1,424 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * fifomon.c --
+ *
+ *      FIFO backlog monitor. See fifomon.h for an overview.
+ *
+ *      Taking a sample only reads FIFO memory and the TSC, so it
+ *      never causes a VM exit and is cheap enough to do every frame.
+ */
+
+#include "fifomon.h"
+#include "timer.h"
+#include "intr.h"
+#include "console.h"
+#include "vmbackdoor.h"
+
+FIFOMonState gFIFOMon;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMonDiv --
+ *
+ *      Divide a 64-bit value by a 32-bit value. We don't link with
+ *      libgcc, so this uses a single 64/32 'divl'. Quotients which
+ *      don't fit in 32 bits saturate.
+ *
+ * Results:
+ *      The quotient.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+FIFOMonDiv(uint64 dividend,  // IN
+           uint32 divisor)   // IN
+{
+   uint32 lo = (uint32)dividend;
+   uint32 hi = (uint32)(dividend >> 32);
+
+   if (hi >= divisor) {
+      return 0xFFFFFFFF;
+   }
+
+   asm ("divl %2" : "+a" (lo), "+d" (hi) : "rm" (divisor));
+   return lo;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMonAppendUInt --
+ *
+ *      Append a decimal number to a string buffer.
+ *
+ * Results:
+ *      Returns a pointer to the end of the string.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char *
+FIFOMonAppendUInt(char *buf,    // IN/OUT
+                  uint32 value) // IN
+{
+   char digits[10];
+   int n = 0;
+
+   do {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+
+   while (n) {
+      *(buf++) = digits[--n];
+   }
+   return buf;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMonTimerISR --
+ *
+ *      PIT interrupt handler, used by FIFOMon_StartTimer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Takes one sample.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FIFOMonTimerISR(int vector)  // IN
+{
+   FIFOMon_Sample();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_Reset --
+ *
+ *      Discard all samples, and start a new time series. The next
+ *      sample's FIFOFull time is measured from this point.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Queries the TSC frequency from the host, the first time
+ *      we're called.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_Reset(void)
+{
+   Bool intrFlag = Intr_Save();
+   Intr_Disable();
+
+   if (!gFIFOMon.mhz) {
+      gFIFOMon.mhz = VMBackdoor_GetMHz();
+      if (!gFIFOMon.mhz) {
+         gFIFOMon.mhz = 1;
+      }
+   }
+
+   gFIFOMon.head = 0;
+   gFIFOMon.count = 0;
+   gFIFOMon.lastFullCycles = gSVGA.fifo.fullCycles;
+
+   Intr_Restore(intrFlag);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_Sample --
+ *
+ *      Record the current FIFO backlog. Call this at frame
+ *      boundaries, or let FIFOMon_StartTimer call it periodically.
+ *      Once the ring is full, the oldest sample is overwritten.
+ *
+ *      This is safe to call from interrupt handlers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Does a FIFOMon_Reset first, if we've never been reset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_Sample(void)
+{
+   volatile uint32 *fifo = gSVGA.fifoMem;
+   Bool intrFlag = Intr_Save();
+   FIFOMonSample *sample;
+   uint32 nextCmd, stop;
+   uint64 fullCycles, fullDelta;
+
+   /* Samples taken before the first FIFOMon_Reset start the series. */
+   if (!gFIFOMon.mhz) {
+      FIFOMon_Reset();
+   }
+
+   Intr_Disable();
+
+   sample = &gFIFOMon.samples[gFIFOMon.head];
+   sample->tsc = Timer_GetTSC();
+
+   /*
+    * The host consumes commands starting at STOP, and we write new
+    * commands at NEXT_CMD. Everything in between is queued.
+    */
+
+   nextCmd = fifo[SVGA_FIFO_NEXT_CMD];
+   stop = fifo[SVGA_FIFO_STOP];
+   if (nextCmd >= stop) {
+      sample->queuedBytes = nextCmd - stop;
+   } else {
+      sample->queuedBytes = (fifo[SVGA_FIFO_MAX] - fifo[SVGA_FIFO_MIN]) - (stop - nextCmd);
+   }
+
+   if (SVGA_HasFIFOCap(SVGA_FIFO_CAP_FENCE)) {
+      sample->fenceLag = gSVGA.fifo.nextFence - 1 - fifo[SVGA_FIFO_FENCE];
+   } else {
+      sample->fenceLag = 0;
+   }
+
+   /*
+    * If we interrupted SVGAFIFOFull while it was updating the
+    * 64-bit counter, we may see a torn value. Clamp the delta rather
+    * than recording a bogus multi-second stall.
+    */
+
+   fullCycles = gSVGA.fifo.fullCycles;
+   fullDelta = fullCycles - gFIFOMon.lastFullCycles;
+   gFIFOMon.lastFullCycles = fullCycles;
+   sample->fullCycles = (fullDelta >> 32) ? 0 : (uint32)fullDelta;
+
+   gFIFOMon.head = (gFIFOMon.head + 1) % FIFOMON_MAX_SAMPLES;
+   if (gFIFOMon.count < FIFOMON_MAX_SAMPLES) {
+      gFIFOMon.count++;
+   }
+
+   Intr_Restore(intrFlag);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_StartTimer --
+ *
+ *      Take samples 'hz' times per second from the PIT interrupt. This
+ *      takes over the PIT, so it can't be used by apps which have
+ *      their own timer handler.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Installs an IRQ 0 handler and programs the PIT.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_StartTimer(uint32 hz)  // IN
+{
+   FIFOMon_Reset();
+   Intr_SetHandler(IRQ_VECTOR(PIT_IRQ), FIFOMonTimerISR);
+   Timer_InitPIT(PIT_HZ / hz);
+   Intr_SetMask(PIT_IRQ, TRUE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_StopTimer --
+ *
+ *      Stop periodic sampling. Existing samples are kept.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Masks IRQ 0.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_StopTimer(void)
+{
+   Intr_SetMask(PIT_IRQ, FALSE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_Dump --
+ *
+ *      Summarize the samples in the ring on the console: average and
+ *      peak backlog, average and peak fence lag, and the fraction of
+ *      the sampled interval we spent blocked on a full FIFO.
+ *
+ *      As a rule of thumb, an app which is often blocked in
+ *      FIFOFull, or which keeps the FIFO mostly full, is host-bound.
+ *      An app with a nearly empty FIFO and little fence lag is
+ *      guest-bound: the host is waiting on us.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the console.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_Dump(void)
+{
+   uint32 fifoSize = gSVGA.fifoMem[SVGA_FIFO_MAX] - gSVGA.fifoMem[SVGA_FIFO_MIN];
+   uint32 first = (gFIFOMon.head + FIFOMON_MAX_SAMPLES - gFIFOMon.count)
+                  % FIFOMON_MAX_SAMPLES;
+   uint32 maxQueued = 0, maxLag = 0;
+   uint64 totalQueued = 0, totalLag = 0, totalFull = 0;
+   uint32 i, elapsedUS, fullUS, avgQueued, avgLag;
+
+   if (gFIFOMon.count < 2 || !gFIFOMon.mhz) {
+      Console_Format("FIFOMon: not enough samples\n");
+      return;
+   }
+
+   for (i = 0; i < gFIFOMon.count; i++) {
+      FIFOMonSample *sample = &gFIFOMon.samples[(first + i) % FIFOMON_MAX_SAMPLES];
+
+      maxQueued = MAX(maxQueued, sample->queuedBytes);
+      maxLag = MAX(maxLag, sample->fenceLag);
+      totalQueued += sample->queuedBytes;
+      totalLag += sample->fenceLag;
+
+      /* The first sample's FIFOFull time predates the interval. */
+      if (i) {
+         totalFull += sample->fullCycles;
+      }
+   }
+
+   elapsedUS = FIFOMonDiv(gFIFOMon.samples[(first + gFIFOMon.count - 1)
+                                           % FIFOMON_MAX_SAMPLES].tsc -
+                          gFIFOMon.samples[first].tsc, gFIFOMon.mhz);
+   fullUS = FIFOMonDiv(totalFull, gFIFOMon.mhz);
+
+   avgQueued = FIFOMonDiv(totalQueued, gFIFOMon.count);
+   avgLag = FIFOMonDiv(totalLag, gFIFOMon.count);
+
+   Console_Format("FIFOMon: %d samples over %d ms\n"
+                  "  queued: avg %d max %d of %d bytes\n"
+                  "  fence lag: avg %d max %d\n"
+                  "  FIFO full: %d ms (%d percent)\n",
+                  gFIFOMon.count, elapsedUS / 1000,
+                  avgQueued, maxQueued, fifoSize,
+                  avgLag, maxLag,
+                  fullUS / 1000,
+                  FIFOMonDiv((uint64)fullUS * 100, MAX(elapsedUS, 1)));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FIFOMon_Export --
+ *
+ *      Write the whole time series to the host's log file
+ *      (vmware.log), one sample per line, oldest first:
+ *
+ *        FIFOMon: <usec>,<queuedBytes>,<fenceLag>,<fullUsec>
+ *
+ *      Timestamps are relative to the oldest sample.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      One backdoor RPC per sample. This is slow; call it after the
+ *      run, not during.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+FIFOMon_Export(void)
+{
+   static const char prefix[] = "log FIFOMon: ";
+   char lineBuf[sizeof prefix + 4 * 11];
+   uint32 first = (gFIFOMon.head + FIFOMON_MAX_SAMPLES - gFIFOMon.count)
+                  % FIFOMON_MAX_SAMPLES;
+   uint32 i;
+
+   memcpy(lineBuf, prefix, sizeof prefix);
+
+   for (i = 0; i < gFIFOMon.count; i++) {
+      FIFOMonSample *sample = &gFIFOMon.samples[(first + i) % FIFOMON_MAX_SAMPLES];
+      char *p = lineBuf + sizeof prefix - 1;
+
+      p = FIFOMonAppendUInt(p, FIFOMonDiv(sample->tsc - gFIFOMon.samples[first].tsc,
+                                          gFIFOMon.mhz));
+      *(p++) = ',';
+      p = FIFOMonAppendUInt(p, sample->queuedBytes);
+      *(p++) = ',';
+      p = FIFOMonAppendUInt(p, sample->fenceLag);
+      *(p++) = ',';
+      p = FIFOMonAppendUInt(p, FIFOMonDiv(sample->fullCycles, gFIFOMon.mhz));
+
+      VMBackdoor_CheckedRPCI(lineBuf, p - lineBuf);
+   }
+}
@@ -0,0 +1,71 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * fifomon.h --
+ *
+ *      FIFO backlog monitor. Periodically records how much work is
+ *      queued in the command FIFO but not yet consumed by the host,
+ *      how far the host's fence lags behind the guest's, and how
+ *      long the guest has spent blocked in SVGAFIFOFull.
+ *
+ *      Samples can be taken at frame boundaries with FIFOMon_Sample(),
+ *      or from the PIT timer interrupt. The most recent samples are
+ *      kept in a ring, which can be summarized on the console or
+ *      exported to the host's log file after a run.
+ */
+
+#ifndef __FIFOMON_H__
+#define __FIFOMON_H__
+
+#include "svga.h"
+
+#define FIFOMON_MAX_SAMPLES  1024
+
+typedef struct FIFOMonSample {
+   uint64  tsc;           // Timestamp of this sample
+   uint32  queuedBytes;   // NEXT_CMD - STOP, modulo the FIFO size
+   uint32  fenceLag;      // Fences inserted but not yet passed
+   uint32  fullCycles;    // Cycles spent in SVGAFIFOFull since the last sample
+} FIFOMonSample;
+
+typedef struct FIFOMonState {
+   FIFOMonSample  samples[FIFOMON_MAX_SAMPLES];
+   uint32         head;          // Next sample slot to write
+   uint32         count;         // Number of valid samples in the ring
+   uint64         lastFullCycles;
+   uint32         mhz;           // TSC frequency, for exporting in microseconds
+} FIFOMonState;
+
+extern FIFOMonState gFIFOMon;
+
+void FIFOMon_Reset(void);
+void FIFOMon_Sample(void);
+void FIFOMon_StartTimer(uint32 hz);
+void FIFOMon_StopTimer(void);
+void FIFOMon_Dump(void);
+void FIFOMon_Export(void);
+
+#endif /* __FIFOMON_H__ */
@@ -0,0 +1,335 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * gmrpool.c --
+ *
+ *      A pool of reusable GMRs. See gmrpool.h for an overview.
+ */
+
+#include "gmrpool.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPoolDefine --
+ *
+ *      Set up a new pool entry: allocate a GMR ID, and either define
+ *      the GMR with its tail mapped (GMR2), or allocate the descriptor
+ *      page we'll rewrite on every remap (registers).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates a GMR ID and memory. May write to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+GMRPoolDefine(GMRPool *pool,         // IN
+              GMRPoolEntry *entry)   // OUT
+{
+   memset(entry, 0, sizeof *entry);
+   entry->gmrId = GMR_AllocId();
+
+   if (pool->useGMR2) {
+      GMR_Define2(entry->gmrId, pool->headPages + pool->tailPages);
+      if (pool->tailPages) {
+         GMR_Remap2(entry->gmrId, pool->headPages, pool->tailPages, pool->tailPPNs);
+      }
+   } else {
+      entry->descPage = Heap_AllocPages(1);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPoolRemap --
+ *
+ *      Point the head of a GMR at a new list of pages. Physically
+ *      adjacent pages share a descriptor.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO, or redefines the GMR immediately via the
+ *      GMR registers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+GMRPoolRemap(GMRPool *pool,          // IN
+             GMRPoolEntry *entry,    // IN
+             const PPN *headPPNs)    // IN
+{
+   SVGAGuestMemDescriptor *desc;
+   uint32 i, n = 0;
+
+   if (pool->useGMR2) {
+      GMR_Remap2(entry->gmrId, 0, pool->headPages, headPPNs);
+      return;
+   }
+
+   desc = PPN_POINTER(entry->descPage);
+
+   for (i = 0; i < pool->headPages; i++) {
+      if (n && desc[n - 1].ppn + desc[n - 1].numPages == headPPNs[i]) {
+         desc[n - 1].numPages++;
+      } else {
+         desc[n].ppn = headPPNs[i];
+         desc[n].numPages = 1;
+         n++;
+      }
+   }
+
+   /*
+    * Continue into the shared tail, or terminate the list.
+    */
+   desc[n].ppn = pool->tailDescriptor;
+   desc[n].numPages = 0;
+
+   SVGA_WriteReg(SVGA_REG_GMR_ID, entry->gmrId);
+   SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, entry->descPage);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPool_Init --
+ *
+ *      Create a pool of 'numGMRs' GMRs. Each one has 'headPages' pages
+ *      which are retargeted by GMRPool_Get, followed by 'tailPages'
+ *      pages which are always mapped to 'tailPPNs'. The tail PPN array
+ *      must stay valid for as long as the pool can grow.
+ *
+ *      Requires GMR_Init. On GMR2 devices, this also does GMR2_Init.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates GMR IDs and memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+GMRPool_Init(GMRPool *pool,        // OUT
+             uint32 numGMRs,       // IN
+             uint32 headPages,     // IN
+             const PPN *tailPPNs,  // IN (optional)
+             uint32 tailPages)     // IN
+{
+   memset(pool, 0, sizeof *pool);
+
+   pool->headPages = headPages;
+   pool->tailPages = tailPages;
+   pool->tailPPNs = tailPPNs;
+   pool->useGMR2 = (gSVGA.capabilities & SVGA_CAP_GMR2) != 0;
+
+   if (pool->useGMR2) {
+      GMR2_Init();
+   } else {
+      if (headPages >= PAGE_SIZE / sizeof(SVGAGuestMemDescriptor)) {
+         SVGA_Panic("GMRPool: Too many head pages for one descriptor page.");
+      }
+
+      if (tailPages) {
+         SVGAGuestMemDescriptor *tail = Heap_Alloc(tailPages * sizeof *tail);
+         uint32 i;
+
+         for (i = 0; i < tailPages; i++) {
+            tail[i].ppn = tailPPNs[i];
+            tail[i].numPages = 1;
+         }
+         pool->tailDescriptor = GMR_AllocDescriptor(tail, tailPages);
+         Heap_Free(tail);
+      }
+   }
+
+   GMRPool_Resize(pool, numGMRs);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPool_Resize --
+ *
+ *      Grow or shrink the pool. GMRs which are checked out are never
+ *      removed, so a pool may stay larger than requested until they
+ *      come back. Removed GMRs are released with GMR_Release, which
+ *      waits for their last use to finish.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates or frees GMR IDs and memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+GMRPool_Resize(GMRPool *pool,    // IN/OUT
+               uint32 numGMRs)   // IN
+{
+   numGMRs = MIN(numGMRs, GMRPOOL_MAX_GMRS);
+
+   while (pool->numGMRs < numGMRs) {
+      GMRPoolDefine(pool, &pool->entries[pool->numGMRs++]);
+   }
+
+   while (pool->numGMRs > numGMRs) {
+      GMRPoolEntry *entry = NULL;
+      uint32 i;
+
+      for (i = pool->numGMRs; i > 0; i--) {
+         if (!pool->entries[i - 1].inUse) {
+            entry = &pool->entries[i - 1];
+            break;
+         }
+      }
+      if (!entry) {
+         break;
+      }
+
+      if (entry->descPage) {
+         Heap_FreePages(entry->descPage, 1);
+      }
+      GMR_Release(entry->gmrId);
+
+      *entry = pool->entries[--pool->numGMRs];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPool_Get --
+ *
+ *      Check out a GMR from the pool, with its head mapped to
+ *      'headPPNs'. We prefer GMRs whose last use has finished. If
+ *      every GMR is checked out, the pool grows.
+ *
+ * Results:
+ *      Returns the GMR ID.
+ *
+ * Side effects:
+ *      Remaps a GMR. If we have to remap through the registers, this
+ *      may wait for the GMR's last use to finish.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+GMRPool_Get(GMRPool *pool,          // IN/OUT
+            const PPN *headPPNs)    // IN
+{
+   GMRPoolEntry *entry = NULL;
+   uint32 i;
+
+   for (i = 0; i < pool->numGMRs; i++) {
+      GMRPoolEntry *candidate = &pool->entries[i];
+
+      if (candidate->inUse) {
+         continue;
+      }
+      if (SVGA_HasFencePassed(candidate->fence)) {
+         entry = candidate;
+         break;
+      }
+      if (!entry || (int32)(candidate->fence - entry->fence) < 0) {
+         entry = candidate;
+      }
+   }
+
+   if (!entry) {
+      if (pool->numGMRs == GMRPOOL_MAX_GMRS) {
+         SVGA_Panic("GMRPool: Every GMR is checked out.");
+      }
+      GMRPool_Resize(pool, pool->numGMRs + 1);
+      entry = &pool->entries[pool->numGMRs - 1];
+   }
+
+   if (!pool->useGMR2 && !SVGA_HasFencePassed(entry->fence)) {
+      pool->numWaits++;
+      SVGA_SyncToFence(entry->fence);
+   }
+
+   GMRPoolRemap(pool, entry, headPPNs);
+
+   entry->inUse = TRUE;
+   pool->numGets++;
+
+   return entry->gmrId;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GMRPool_Put --
+ *
+ *      Return a GMR to the pool. 'fence' must come after the last
+ *      command which uses the GMR.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Panics if the GMR isn't checked out from this pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+GMRPool_Put(GMRPool *pool,    // IN/OUT
+            uint32 gmrId,     // IN
+            uint32 fence)     // IN
+{
+   uint32 i;
+
+   for (i = 0; i < pool->numGMRs; i++) {
+      GMRPoolEntry *entry = &pool->entries[i];
+
+      if (entry->gmrId == gmrId && entry->inUse) {
+         entry->fence = fence;
+         entry->inUse = FALSE;
+         return;
+      }
+   }
+
+   SVGA_Panic("GMRPool_Put: GMR is not checked out.");
+}
@@ -0,0 +1,81 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * gmrpool.h --
+ *
+ *      A pool of reusable GMRs, for drivers which need a short-lived
+ *      GMR for each DMA transfer.
+ *
+ *      Every GMR in the pool has the same layout: a "head" of pages
+ *      which are retargeted each time the GMR is handed out, followed
+ *      by an optional fixed "tail" which is mapped once. GMR IDs and
+ *      descriptor pages are allocated once and recycled, so handing
+ *      out a GMR costs only a remap.
+ *
+ *      Callers give each GMR back along with the fence of its last
+ *      use. On GMR2 devices, remapping is a FIFO command which is
+ *      ordered after that use, so a GMR can be recycled immediately.
+ *      Otherwise we remap through the GMR registers, which means
+ *      waiting for the fence first; we prefer GMRs whose fences have
+ *      already passed.
+ */
+
+#ifndef __GMRPOOL_H__
+#define __GMRPOOL_H__
+
+#include "svga.h"
+#include "gmr.h"
+
+#define GMRPOOL_MAX_GMRS  64
+
+typedef struct GMRPoolEntry {
+   uint32  gmrId;
+   uint32  fence;        // Fence of the last use
+   Bool    inUse;
+   PPN     descPage;     // Descriptor head, when remapping through registers
+} GMRPoolEntry;
+
+typedef struct GMRPool {
+   uint32        headPages;
+   uint32        tailPages;
+   const PPN    *tailPPNs;
+   PPN           tailDescriptor;   // Shared by every GMR in the register path
+   Bool          useGMR2;
+
+   uint32        numGMRs;
+   GMRPoolEntry  entries[GMRPOOL_MAX_GMRS];
+
+   uint32        numGets;
+   uint32        numWaits;         // Gets that had to wait for a fence
+} GMRPool;
+
+void GMRPool_Init(GMRPool *pool, uint32 numGMRs, uint32 headPages,
+                  const PPN *tailPPNs, uint32 tailPages);
+uint32 GMRPool_Get(GMRPool *pool, const PPN *headPPNs);
+void GMRPool_Put(GMRPool *pool, uint32 gmrId, uint32 fence);
+void GMRPool_Resize(GMRPool *pool, uint32 numGMRs);
+
+#endif /* __GMRPOOL_H__ */
@@ -0,0 +1,354 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * memstats.c --
+ *
+ *      Memory accounting report. See memstats.h for an overview.
+ */
+
+#include "memstats.h"
+#include "gmr.h"
+#include "svga3dutil.h"
+#include "residency.h"
+#include "console.h"
+#include "vmbackdoor.h"
+
+#define MEMSTATS_MAX_NAME    32
+#define MEMSTATS_MAX_VALUES  5
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStatsAppendUInt --
+ *
+ *      Append a decimal number to a string buffer.
+ *
+ * Results:
+ *      Returns a pointer to the end of the string.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char *
+MemStatsAppendUInt(char *buf,    // IN/OUT
+                   uint32 value) // IN
+{
+   char digits[10];
+   int n = 0;
+
+   do {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+   } while (value);
+
+   while (n) {
+      *(buf++) = digits[--n];
+   }
+   return buf;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStatsLog --
+ *
+ *      Write one line to the host's log file:
+ *
+ *        MemStats: <name>,<value>,<value>,...
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      One backdoor RPC.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemStatsLog(const char *name,      // IN
+            const uint32 *values,  // IN
+            uint32 count)          // IN
+{
+   static const char prefix[] = "log MemStats: ";
+   char lineBuf[sizeof prefix + MEMSTATS_MAX_NAME + MEMSTATS_MAX_VALUES * 11];
+   char *p = lineBuf + sizeof prefix - 1;
+   uint32 i;
+
+   memcpy(lineBuf, prefix, sizeof prefix);
+
+   for (i = 0; name[i] && i < MEMSTATS_MAX_NAME; i++) {
+      *(p++) = name[i];
+   }
+   for (i = 0; i < count && i < MEMSTATS_MAX_VALUES; i++) {
+      *(p++) = ',';
+      p = MemStatsAppendUInt(p, values[i]);
+   }
+
+   VMBackdoor_CheckedRPCI(lineBuf, p - lineBuf);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStatsLogCounter --
+ *
+ *      Log a counter as <name>,<current>,<peak>,<allocs>,<frees>.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      One backdoor RPC.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemStatsLogCounter(const char *name,               // IN
+                   const SVGAMemCounter *counter)  // IN
+{
+   uint32 values[] = { counter->current, counter->peak,
+                       counter->allocs, counter->frees };
+
+   MemStatsLog(name, values, arraysize(values));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStatsFIFOSize --
+ *
+ *      Usable size of the command FIFO, or 0 if SVGA_Init hasn't
+ *      mapped it yet.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+MemStatsFIFOSize(void)
+{
+   if (!gSVGA.fifoMem) {
+      return 0;
+   }
+   return gSVGA.fifoMem[SVGA_FIFO_MAX] - gSVGA.fifoMem[SVGA_FIFO_MIN];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStats_Dump --
+ *
+ *      Print the memory report on the console: a table of current
+ *      use, peak use, and allocation and free counts for each
+ *      allocator, followed by a summary of each kind of memory.
+ *
+ *      Heap and VRAM sizes are in bytes, heap pages are 4 KB, and
+ *      GMR and surface IDs are counted individually. Heap_Reset and
+ *      GMR_FreeAll zero the current use of their counters, but peaks
+ *      cover the whole run.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the console.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+MemStats_Dump(void)
+{
+   const SVGAMemCounter *counters[5];
+   static const char *names[5] = {
+      "heap bytes ",
+      "heap pages ",
+      "VRAM bytes ",
+      "GMR IDs    ",
+      "surface IDs",
+   };
+   HeapStats heap;
+   SVGAVRAMStats vram;
+   SVGAMemCounter sids;
+   uint32 pendingSids, i;
+
+   Heap_GetStats(&heap);
+   SVGA_GetVRAMStats(&vram);
+   SVGA3DUtil_GetSurfaceIDStats(&sids, &pendingSids);
+
+   counters[0] = &heap.bytes;
+   counters[1] = &heap.pages;
+   counters[2] = &vram.bytes;
+   counters[3] = &gGMR.ids;
+   counters[4] = &sids;
+
+   Console_Format("Memory:          current      peak    allocs     frees\n");
+   for (i = 0; i < arraysize(counters); i++) {
+      Console_Format("  %s%10d%10d%10d%10d\n", names[i],
+                     counters[i]->current, counters[i]->peak,
+                     counters[i]->allocs, counters[i]->frees);
+   }
+
+   Console_Format("  heap: %d KB footprint, %d KB peak, %d KB limit\n"
+                  "  VRAM: %d of %d KB free, largest block %d KB, %d failures\n"
+                  "  GMR descriptors: %d in, %d out, %d pages\n"
+                  "  surfaces: %d destroys pending, %d of %d managed bytes, "
+                  "%d evictions\n"
+                  "  FIFO: %d bytes, largest command %d, %d bounced, %d full\n",
+                  heap.footprint / 1024, heap.peakFootprint / 1024,
+                  heap.limit / 1024,
+                  vram.freeBytes / 1024, vram.totalBytes / 1024,
+                  vram.largestFree / 1024, vram.failures,
+                  gGMR.descriptorsIn, gGMR.descriptorsOut, gGMR.descriptorPages,
+                  pendingSids, gResidency.residentBytes, gResidency.budget,
+                  gResidency.evictions,
+                  MemStatsFIFOSize(), gSVGA.fifo.peakReserved,
+                  gSVGA.fifo.bounceCount, gSVGA.fifo.fullCount);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStats_Export --
+ *
+ *      Write the memory report to the host's log file (vmware.log),
+ *      one line per category:
+ *
+ *        MemStats: heap.bytes,<current>,<peak>,<allocs>,<frees>
+ *        MemStats: heap.pages,<current>,<peak>,<allocs>,<frees>
+ *        MemStats: heap.footprint,<bytes>,<peak>,<limit>
+ *        MemStats: vram.bytes,<current>,<peak>,<allocs>,<frees>
+ *        MemStats: vram.free,<total>,<free>,<largest>,<failures>
+ *        MemStats: gmr.ids,<current>,<peak>,<allocs>,<frees>
+ *        MemStats: gmr.descriptors,<in>,<out>,<pages>
+ *        MemStats: surface.ids,<current>,<peak>,<allocs>,<frees>,<pending>
+ *        MemStats: surface.managed,<resident>,<budget>,<uploads>,<evictions>
+ *        MemStats: fifo,<size>,<largest>,<bounced>,<full>
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      One backdoor RPC per line.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+MemStats_Export(void)
+{
+   uint32 values[MEMSTATS_MAX_VALUES];
+   HeapStats heap;
+   SVGAVRAMStats vram;
+   SVGAMemCounter sids;
+   uint32 pendingSids;
+
+   Heap_GetStats(&heap);
+   SVGA_GetVRAMStats(&vram);
+   SVGA3DUtil_GetSurfaceIDStats(&sids, &pendingSids);
+
+   MemStatsLogCounter("heap.bytes", &heap.bytes);
+   MemStatsLogCounter("heap.pages", &heap.pages);
+   values[0] = heap.footprint;
+   values[1] = heap.peakFootprint;
+   values[2] = heap.limit;
+   MemStatsLog("heap.footprint", values, 3);
+
+   MemStatsLogCounter("vram.bytes", &vram.bytes);
+   values[0] = vram.totalBytes;
+   values[1] = vram.freeBytes;
+   values[2] = vram.largestFree;
+   values[3] = vram.failures;
+   MemStatsLog("vram.free", values, 4);
+
+   MemStatsLogCounter("gmr.ids", &gGMR.ids);
+   values[0] = gGMR.descriptorsIn;
+   values[1] = gGMR.descriptorsOut;
+   values[2] = gGMR.descriptorPages;
+   MemStatsLog("gmr.descriptors", values, 3);
+
+   values[0] = sids.current;
+   values[1] = sids.peak;
+   values[2] = sids.allocs;
+   values[3] = sids.frees;
+   values[4] = pendingSids;
+   MemStatsLog("surface.ids", values, 5);
+
+   values[0] = gResidency.residentBytes;
+   values[1] = gResidency.budget;
+   values[2] = gResidency.uploads;
+   values[3] = gResidency.evictions;
+   MemStatsLog("surface.managed", values, 4);
+
+   values[0] = MemStatsFIFOSize();
+   values[1] = gSVGA.fifo.peakReserved;
+   values[2] = gSVGA.fifo.bounceCount;
+   values[3] = gSVGA.fifo.fullCount;
+   MemStatsLog("fifo", values, 4);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemStatsPanicHook --
+ * MemStats_ReportOnPanic --
+ *
+ *      Dump and export the memory report if the app panics. Running
+ *      out of heap, VRAM or IDs all end in a panic, so this is where
+ *      the report is most useful.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces any previous SVGA panic hook.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemStatsPanicHook(void)
+{
+   MemStats_Dump();
+   MemStats_Export();
+}
+
+void
+MemStats_ReportOnPanic(void)
+{
+   SVGA_SetPanicHook(MemStatsPanicHook);
+}
@@ -0,0 +1,49 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * memstats.h --
+ *
+ *      Memory accounting report. The heap, the VRAM allocator, the
+ *      GMR and surface ID allocators, and the FIFO each keep their
+ *      own counters of current use, peak use, and allocations. This
+ *      module collects them into a single report, so VM memory and
+ *      VRAM sizes can be chosen from what an app really used.
+ *
+ *      The report can be printed on the console or written to the
+ *      host's log file at any time. MemStats_ReportOnPanic does both
+ *      when the app panics, which is how most of our apps exit.
+ */
+
+#ifndef __MEMSTATS_H__
+#define __MEMSTATS_H__
+
+#include "svga.h"
+
+void MemStats_Dump(void);
+void MemStats_Export(void);
+void MemStats_ReportOnPanic(void);
+
+#endif /* __MEMSTATS_H__ */
@@ -0,0 +1,442 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * residency.c --
+ *
+ *      Host memory budget for managed surfaces. See residency.h for
+ *      an overview.
+ */
+
+#include "residency.h"
+
+#define EVICT_BATCH  32
+
+ResidencyState gResidency;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidencyGetSizes --
+ *
+ *      Fill in the face and mip size arrays for a managed surface.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ResidencyGetSizes(const ManagedSurface *surf,  // IN
+                  SVGA3dSurfaceFace *faces,    // OUT
+                  SVGA3dSize *mipSizes)        // OUT
+{
+   uint32 level;
+
+   memset(faces, 0, sizeof *faces * SVGA3D_MAX_SURFACE_FACES);
+   faces[0].numMipLevels = surf->numMipLevels;
+
+   for (level = 0; level < surf->numMipLevels; level++) {
+      mipSizes[level].width = MAX(1, surf->width >> level);
+      mipSizes[level].height = MAX(1, surf->height >> level);
+      mipSizes[level].depth = 1;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidencyUnlink --
+ *
+ *      Remove a resident surface from the LRU list.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ResidencyUnlink(ManagedSurface *surf)  // IN/OUT
+{
+   if (surf->prev) {
+      surf->prev->next = surf->next;
+   } else {
+      gResidency.lru = surf->next;
+   }
+   if (surf->next) {
+      surf->next->prev = surf->prev;
+   } else {
+      gResidency.mru = surf->prev;
+   }
+   surf->prev = surf->next = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidencyIsIdle --
+ *
+ *      Has the host finished with this surface's last use? Without
+ *      FIFO fences we can't tell, so every surface counts as idle.
+ *      Evicting a busy surface is still safe, since the destroy is
+ *      ordered after its pending uses; it's just wasteful.
+ *
+ * Results:
+ *      TRUE if the surface may be evicted.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+ResidencyIsIdle(const ManagedSurface *surf)  // IN
+{
+   return !SVGA_HasFIFOCap(SVGA_FIFO_CAP_FENCE) || SVGA_HasFencePassed(surf->fence);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidencyMakeRoom --
+ *
+ *      Evict idle surfaces, least recently used first, until 'bytes'
+ *      more would fit within the budget. The destroys are batched.
+ *
+ * Results:
+ *      TRUE if there is now room.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+ResidencyMakeRoom(uint32 bytes)  // IN
+{
+   uint32 sids[EVICT_BATCH];
+   uint32 numSids = 0;
+   ManagedSurface *surf = gResidency.lru;
+
+   while (surf && gResidency.residentBytes + bytes > gResidency.budget) {
+      ManagedSurface *next = surf->next;
+
+      if (ResidencyIsIdle(surf)) {
+         sids[numSids++] = surf->sid;
+         if (numSids == EVICT_BATCH) {
+            SVGA3DUtil_DestroySurfacesDeferred(sids, numSids);
+            numSids = 0;
+         }
+
+         ResidencyUnlink(surf);
+         surf->sid = SVGA3D_INVALID_ID;
+         gResidency.residentBytes -= surf->bytes;
+         gResidency.evictions++;
+      }
+      surf = next;
+   }
+
+   if (numSids) {
+      SVGA3DUtil_DestroySurfacesDeferred(sids, numSids);
+   }
+
+   return gResidency.residentBytes + bytes <= gResidency.budget;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResidencyUpload --
+ *
+ *      Define a managed surface on the host, and upload every mip
+ *      level from its guest copy.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO. Allocates a surface ID.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ResidencyUpload(ManagedSurface *surf)  // IN/OUT
+{
+   SVGA3dSurfaceFace faces[SVGA3D_MAX_SURFACE_FACES];
+   SVGA3dSize sizes[RESIDENCY_MAX_MIP_LEVELS];
+   SVGA3dSurfaceFace *cmdFaces;
+   SVGA3dSize *cmdSizes;
+   SVGA3dGuestImage guestImage;
+   uint32 level;
+
+   ResidencyGetSizes(surf, faces, sizes);
+
+   surf->sid = SVGA3DUtil_AllocSurfaceID();
+   SVGA3D_BeginDefineSurface(surf->sid, surf->flags, surf->format,
+                             &cmdFaces, &cmdSizes, surf->numMipLevels);
+   memcpy(cmdFaces, faces, sizeof faces);
+   memcpy(cmdSizes, sizes, sizeof *sizes * surf->numMipLevels);
+   SVGA_FIFOCommitAll();
+
+   guestImage.ptr = surf->copy;
+   guestImage.pitch = 0;
+
+   for (level = 0; level < surf->numMipLevels; level++) {
+      SVGA3dSurfaceImageId hostImage = { surf->sid, 0, level };
+      SVGA3dCopyBox *boxes;
+
+      SVGA3D_BeginSurfaceDMA(&guestImage, &hostImage, SVGA3D_WRITE_HOST_VRAM,
+                             &boxes, 1);
+      boxes[0].w = sizes[level].width;
+      boxes[0].h = sizes[level].height;
+      boxes[0].d = 1;
+      SVGA_FIFOCommitAll();
+
+      guestImage.ptr.offset += SVGA3DUtil_SurfaceSize2D(sizes[level].width,
+                                                        sizes[level].height,
+                                                        surf->format);
+   }
+
+   gResidency.uploads++;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_Init --
+ *
+ *      Start tracking managed surfaces, with a host memory budget of
+ *      'budget' bytes.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Forgets about any existing managed surfaces.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Residency_Init(uint32 budget)  // IN
+{
+   memset(&gResidency, 0, sizeof gResidency);
+   gResidency.budget = budget;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_SetBudget --
+ *
+ *      Change the budget. If we're over the new budget, evict idle
+ *      surfaces right away.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Residency_SetBudget(uint32 budget)  // IN
+{
+   gResidency.budget = budget;
+   ResidencyMakeRoom(0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_DefineSurface --
+ *
+ *      Set up a managed surface. 'copy' holds the contents of every
+ *      mip level, largest first, each one tightly packed. It must
+ *      stay valid and unchanged until the surface is destroyed.
+ *
+ *      The surface isn't created on the host until its first use.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Residency_DefineSurface(ManagedSurface *surf,        // OUT
+                        uint32 width,                // IN
+                        uint32 height,               // IN
+                        uint32 numMipLevels,         // IN
+                        SVGA3dSurfaceFormat format,  // IN
+                        uint32 flags,                // IN
+                        const SVGAGuestPtr *copy)    // IN
+{
+   SVGA3dSurfaceFace faces[SVGA3D_MAX_SURFACE_FACES];
+   SVGA3dSize sizes[RESIDENCY_MAX_MIP_LEVELS];
+
+   if (numMipLevels < 1 || numMipLevels > RESIDENCY_MAX_MIP_LEVELS) {
+      SVGA_Panic("Residency: Bad number of mip levels.");
+   }
+
+   memset(surf, 0, sizeof *surf);
+   surf->sid = SVGA3D_INVALID_ID;
+   surf->width = width;
+   surf->height = height;
+   surf->numMipLevels = numMipLevels;
+   surf->format = format;
+   surf->flags = flags;
+   surf->copy = *copy;
+
+   ResidencyGetSizes(surf, faces, sizes);
+   surf->bytes = SVGA3DUtil_SurfaceSize(format, faces, sizes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_Use --
+ *
+ *      Get a managed surface ready for use by the next commands we
+ *      write. If it was evicted, make room for it and re-upload it.
+ *
+ * Results:
+ *      Returns the surface's current sid.
+ *
+ * Side effects:
+ *      May evict other surfaces. May write to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+Residency_Use(ManagedSurface *surf)  // IN/OUT
+{
+   if (surf->sid == SVGA3D_INVALID_ID) {
+      if (!ResidencyMakeRoom(surf->bytes)) {
+         gResidency.overBudget++;
+      }
+      ResidencyUpload(surf);
+      gResidency.residentBytes += surf->bytes;
+   } else {
+      ResidencyUnlink(surf);
+   }
+
+   surf->prev = gResidency.mru;
+   if (gResidency.mru) {
+      gResidency.mru->next = surf;
+   } else {
+      gResidency.lru = surf;
+   }
+   gResidency.mru = surf;
+
+   /*
+    * Our use comes before the next fence anyone inserts.
+    */
+   surf->fence = gSVGA.fifo.nextFence ? gSVGA.fifo.nextFence : 1;
+
+   return surf->sid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_Evict --
+ *
+ *      Destroy a managed surface's host copy now, whether or not it's
+ *      idle. It will be re-uploaded on its next use.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Residency_Evict(ManagedSurface *surf)  // IN/OUT
+{
+   if (surf->sid != SVGA3D_INVALID_ID) {
+      Residency_DestroySurface(surf);
+      gResidency.evictions++;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Residency_DestroySurface --
+ *
+ *      Stop managing a surface. The guest copy belongs to the caller,
+ *      and may be freed once the host is done with the surface.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Residency_DestroySurface(ManagedSurface *surf)  // IN/OUT
+{
+   if (surf->sid != SVGA3D_INVALID_ID) {
+      SVGA3DUtil_DestroySurfaceDeferred(surf->sid);
+      ResidencyUnlink(surf);
+      surf->sid = SVGA3D_INVALID_ID;
+      gResidency.residentBytes -= surf->bytes;
+   }
+}
@@ -0,0 +1,90 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * residency.h --
+ *
+ *      Host memory budget for managed surfaces.
+ *
+ *      A managed surface is a 2D texture or buffer whose contents
+ *      are also kept in guest memory, like a D3D managed-pool
+ *      resource. We track how much host memory our resident managed
+ *      surfaces use. When defining another one would exceed the
+ *      budget, the least recently used surfaces are destroyed. An
+ *      evicted surface is re-created and re-uploaded from its guest
+ *      copy the next time it's used.
+ *
+ *      Residency_Use must be called each time a surface is about to
+ *      be referenced by a command; it returns the current sid, which
+ *      may change after an eviction. A surface's last use is the next
+ *      fence inserted after Residency_Use. Surfaces whose last use
+ *      hasn't passed aren't evicted, so a frame's working set stays
+ *      resident even if it exceeds the budget.
+ */
+
+#ifndef __RESIDENCY_H__
+#define __RESIDENCY_H__
+
+#include "svga3dutil.h"
+
+#define RESIDENCY_MAX_MIP_LEVELS  16
+
+typedef struct ManagedSurface {
+   uint32                  sid;           // SVGA3D_INVALID_ID while evicted
+   uint32                  width;
+   uint32                  height;
+   uint32                  numMipLevels;
+   SVGA3dSurfaceFormat     format;
+   uint32                  flags;
+   uint32                  bytes;
+   SVGAGuestPtr            copy;          // Every mip level, tightly packed
+   uint32                  fence;         // Last use
+   struct ManagedSurface  *prev;          // LRU list of resident surfaces
+   struct ManagedSurface  *next;
+} ManagedSurface;
+
+typedef struct ResidencyState {
+   uint32           budget;
+   uint32           residentBytes;
+   ManagedSurface  *lru;                  // Least recently used
+   ManagedSurface  *mru;                  // Most recently used
+
+   uint32           uploads;              // Surfaces (re-)created
+   uint32           evictions;
+   uint32           overBudget;           // Uses which couldn't make room
+} ResidencyState;
+
+extern ResidencyState gResidency;
+
+void Residency_Init(uint32 budget);
+void Residency_SetBudget(uint32 budget);
+void Residency_DefineSurface(ManagedSurface *surf, uint32 width, uint32 height,
+                             uint32 numMipLevels, SVGA3dSurfaceFormat format,
+                             uint32 flags, const SVGAGuestPtr *copy);
+uint32 Residency_Use(ManagedSurface *surf);
+void Residency_Evict(ManagedSurface *surf);
+void Residency_DestroySurface(ManagedSurface *surf);
+
+#endif /* __RESIDENCY_H__ */
@@ -0,0 +1,260 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * surfcache.c --
+ *
+ *      Cache of idle surfaces. See surfcache.h for an overview.
+ */
+
+#include "surfcache.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SurfaceCache_Init --
+ *
+ *      Set up an empty surface cache which keeps at most 'budget'
+ *      bytes of idle surfaces.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SurfaceCache_Init(SurfaceCache *cache,  // OUT
+                  uint32 budget)        // IN
+{
+   memset(cache, 0, sizeof *cache);
+   cache->budget = budget;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SurfaceCacheEvictLRU --
+ *
+ *      Remove the least recently used idle surface from the cache.
+ *      The caller destroys it.
+ *
+ * Results:
+ *      Returns the evicted surface ID, or SVGA3D_INVALID_ID if no
+ *      surface is idle.
+ *
+ * Side effects:
+ *      Reorders the entry table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+SurfaceCacheEvictLRU(SurfaceCache *cache)  // IN/OUT
+{
+   SurfaceCacheEntry *lru = NULL;
+   uint32 sid, i;
+
+   for (i = 0; i < cache->numEntries; i++) {
+      SurfaceCacheEntry *entry = &cache->entries[i];
+
+      if (!entry->inUse && (!lru || entry->lastUse < lru->lastUse)) {
+         lru = entry;
+      }
+   }
+   if (!lru) {
+      return SVGA3D_INVALID_ID;
+   }
+
+   sid = lru->sid;
+   cache->idleBytes -= lru->bytes;
+   *lru = cache->entries[--cache->numEntries];
+
+   return sid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SurfaceCache_Get --
+ *
+ *      Get a surface with the given size, format, and surface flags.
+ *      If an idle one is finished with its last use, it's reused.
+ *      Otherwise we define a new surface.
+ *
+ *      The contents of a reused surface are undefined.
+ *
+ * Results:
+ *      Returns a surface ID.
+ *
+ * Side effects:
+ *      May define a surface. If the entry table is full, destroys
+ *      the least recently used idle surface to make room.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+SurfaceCache_Get(SurfaceCache *cache,         // IN/OUT
+                 uint32 width,                // IN
+                 uint32 height,               // IN
+                 SVGA3dSurfaceFormat format,  // IN
+                 uint32 flags)                // IN
+{
+   SurfaceCacheEntry *entry;
+   uint32 i;
+
+   for (i = 0; i < cache->numEntries; i++) {
+      entry = &cache->entries[i];
+
+      if (!entry->inUse &&
+          entry->width == width &&
+          entry->height == height &&
+          entry->format == format &&
+          entry->flags == flags &&
+          SVGA_HasFencePassed(entry->fence)) {
+
+         entry->inUse = TRUE;
+         cache->idleBytes -= entry->bytes;
+         cache->hits++;
+         return entry->sid;
+      }
+   }
+
+   cache->misses++;
+
+   if (cache->numEntries == SURFACE_CACHE_MAX_ENTRIES) {
+      uint32 sid = SurfaceCacheEvictLRU(cache);
+
+      if (sid == SVGA3D_INVALID_ID) {
+         SVGA_Panic("Surface cache full");
+      }
+      SVGA3DUtil_DestroySurfacesDeferred(&sid, 1);
+   }
+
+   entry = &cache->entries[cache->numEntries++];
+   memset(entry, 0, sizeof *entry);
+
+   entry->sid = SVGA3DUtil_DefineSurface2DFlags(width, height, format, flags);
+   entry->width = width;
+   entry->height = height;
+   entry->format = format;
+   entry->flags = flags;
+   entry->bytes = SVGA3DUtil_SurfaceSize2D(width, height, format);
+   entry->inUse = TRUE;
+
+   return entry->sid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SurfaceCache_Put --
+ *
+ *      Give a surface back to the cache. 'fence' must come after the
+ *      last command which uses it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May destroy idle surfaces, if we're over budget. Panics if the
+ *      surface didn't come from this cache.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SurfaceCache_Put(SurfaceCache *cache,  // IN/OUT
+                 uint32 sid,           // IN
+                 uint32 fence)         // IN
+{
+   uint32 i;
+
+   for (i = 0; i < cache->numEntries; i++) {
+      SurfaceCacheEntry *entry = &cache->entries[i];
+
+      if (entry->sid == sid && entry->inUse) {
+         entry->inUse = FALSE;
+         entry->fence = fence;
+         entry->lastUse = ++cache->clock;
+         cache->idleBytes += entry->bytes;
+
+         if (cache->idleBytes > cache->budget) {
+            SurfaceCache_Trim(cache, cache->budget);
+         }
+         return;
+      }
+   }
+
+   SVGA_Panic("SurfaceCache_Put: Surface is not checked out.");
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SurfaceCache_Trim --
+ *
+ *      Destroy least recently used idle surfaces until at most
+ *      'budget' bytes of idle surfaces remain. Their IDs are
+ *      recycled once the destroys have been processed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SurfaceCache_Trim(SurfaceCache *cache,  // IN/OUT
+                  uint32 budget)        // IN
+{
+   uint32 sids[SURFACE_CACHE_MAX_ENTRIES];
+   uint32 numSids = 0;
+
+   while (cache->idleBytes > budget) {
+      uint32 sid = SurfaceCacheEvictLRU(cache);
+
+      if (sid == SVGA3D_INVALID_ID) {
+         break;
+      }
+      sids[numSids++] = sid;
+   }
+
+   if (numSids) {
+      SVGA3DUtil_DestroySurfacesDeferred(sids, numSids);
+   }
+}
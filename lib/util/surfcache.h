@@ -0,0 +1,81 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * surfcache.h --
+ *
+ *      A cache of idle surfaces, for apps which need short-lived
+ *      render targets, textures, or buffers.
+ *
+ *      Defining a surface makes the host allocate memory for it.
+ *      Instead, apps can get a surface from the cache and put it back
+ *      when they're done, along with the fence of its last use. The
+ *      cache hands out an idle surface with the same size, format,
+ *      and flags when it has one whose fence has passed, and defines
+ *      a new surface otherwise.
+ *
+ *      The total size of idle surfaces is kept under a budget. When
+ *      it's over, the least recently used idle surfaces are
+ *      destroyed.
+ */
+
+#ifndef __SURFCACHE_H__
+#define __SURFCACHE_H__
+
+#include "svga3dutil.h"
+
+#define SURFACE_CACHE_MAX_ENTRIES  64
+
+typedef struct SurfaceCacheEntry {
+   uint32               sid;
+   uint32               width;
+   uint32               height;
+   SVGA3dSurfaceFormat  format;
+   uint32               flags;
+   uint32               bytes;
+   uint32               fence;      // Last use, while idle
+   uint32               lastUse;    // Value of the cache's clock when put back
+   Bool                 inUse;
+} SurfaceCacheEntry;
+
+typedef struct SurfaceCache {
+   SurfaceCacheEntry  entries[SURFACE_CACHE_MAX_ENTRIES];
+   uint32             numEntries;
+   uint32             clock;
+
+   uint32             budget;       // Maximum bytes of idle surfaces
+   uint32             idleBytes;
+
+   uint32             hits;
+   uint32             misses;
+} SurfaceCache;
+
+void SurfaceCache_Init(SurfaceCache *cache, uint32 budget);
+uint32 SurfaceCache_Get(SurfaceCache *cache, uint32 width, uint32 height,
+                        SVGA3dSurfaceFormat format, uint32 flags);
+void SurfaceCache_Put(SurfaceCache *cache, uint32 sid, uint32 fence);
+void SurfaceCache_Trim(SurfaceCache *cache, uint32 budget);
+
+#endif /* __SURFCACHE_H__ */
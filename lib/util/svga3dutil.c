@@ -32,6 +32,7 @@
 
 #include "svga3dutil.h"
 #include "intr.h"
+#include "gmr.h"
 
 FullscreenState gFullscreen;
 
@@ -69,8 +70,56 @@ void
 SVGA3DUtil_InitFullscreen(uint32 cid,     // IN
                           uint32 width,   // IN
                           uint32 height)  // IN
+{
+   SVGA3DUtil_InitFullscreenBuffered(cid, width, height, 1, 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_InitFullscreenBuffered --
+ *
+ *      Like SVGA3DUtil_InitFullscreen, but lets the caller choose how
+ *      many Present commands may be in flight, and how many color
+ *      buffers to rotate through.
+ *
+ *      More frames in flight lets the guest run further ahead of the
+ *      host, trading latency for throughput. With a single color
+ *      buffer, each frame is still rendered into the surface that the
+ *      previous Present is reading from; extra color buffers let the
+ *      host work on frame N's Present while frame N+1 is rendered
+ *      somewhere else. It rarely makes sense to have more color
+ *      buffers than frames in flight.
+ *
+ * Results:
+ *      void.
+ *
+ * Side effects:
+ *      Panic if anything fails.
+ *      Stores the fullscreen color buffer surface IDs.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_InitFullscreenBuffered(uint32 cid,              // IN
+                                  uint32 width,            // IN
+                                  uint32 height,           // IN
+                                  uint32 framesInFlight,   // IN
+                                  uint32 numColorBuffers)  // IN
 {
    SVGA3dRenderState *rs;
+   uint32 i;
+
+   if (framesInFlight < 1 || framesInFlight > FULLSCREEN_MAX_FRAMES ||
+       numColorBuffers < 1 || numColorBuffers > FULLSCREEN_MAX_FRAMES) {
+      SVGA_Panic("Unsupported number of fullscreen frames or color buffers.");
+   }
+
+   gFullscreen.cid = cid;
+   gFullscreen.framesInFlight = framesInFlight;
+   gFullscreen.numColorBuffers = numColorBuffers;
 
    gFullscreen.screen.x = 0;
    gFullscreen.screen.y = 0;
@@ -85,8 +134,11 @@ SVGA3DUtil_InitFullscreen(uint32 cid,     // IN
    VMBackdoor_MouseInit(TRUE);
    SVGA3D_Init();
 
-   gFullscreen.colorImage.sid = SVGA3DUtil_DefineSurface2D(width, height,
-                                                           SVGA3D_X8R8G8B8);
+   for (i = 0; i < numColorBuffers; i++) {
+      gFullscreen.colorSids[i] = SVGA3DUtil_DefineSurface2D(width, height,
+                                                            SVGA3D_X8R8G8B8);
+   }
+   gFullscreen.colorImage.sid = gFullscreen.colorSids[0];
 
    gFullscreen.depthImage.sid = SVGA3DUtil_DefineSurface2D(width, height,
                                                            SVGA3D_Z_D16);
@@ -134,18 +186,19 @@ SVGA3DUtil_InitFullscreen(uint32 cid,     // IN
  *
  *      It also includes the recommended flow control, to prevent
  *      the SVGA3D device from lagging too far behind the driver-
- *      we use FIFO fences to ensure that only one Present command
- *      is in the FIFO at once.
+ *      we use FIFO fences to ensure that at most
+ *      gFullscreen.framesInFlight Present commands are in the FIFO at
+ *      once (by default, just one).
  *
  *      This is much better than performing a full Sync after each
  *      Present, since it allows the guest to be preparing frame N+1
  *      while the host is still rendering frame N.
  *
- *      Note that this simplified logic needs to be modified if the
- *      application/driver is presenting from multiple
- *      surfaces. Ideally, we actaully want only a single frame per
- *      surface in the FIFO at once.  It is recommended that drivers
- *      store lastPresentFence per-surface.
+ *      If we have multiple color buffers, the next one is bound as
+ *      the render target after presenting. The host executes the
+ *      FIFO in order, so rendering into a buffer can't overtake an
+ *      earlier Present from it, and the fence ring above is the only
+ *      throttle we need.
  *
  * Results:
  *      None.
@@ -160,8 +213,13 @@ void
 SVGA3DUtil_PresentFullscreen(void)
 {
    SVGA3dCopyRect *cr;
+   uint32 slot = gFullscreen.frame % gFullscreen.framesInFlight;
+   uint32 fence;
 
-   SVGA_SyncToFence(gFullscreen.lastPresentFence);
+   /*
+    * Wait for the present that was issued 'framesInFlight' frames ago.
+    */
+   SVGA_SyncToFence(gFullscreen.presentFences[slot]);
 
    SVGA3D_BeginPresent(gFullscreen.colorImage.sid, &cr, 1);
    memset(cr, 0, sizeof *cr);
@@ -169,7 +227,240 @@ SVGA3DUtil_PresentFullscreen(void)
    cr->h = gSVGA.height;
    SVGA_FIFOCommitAll();
 
-   gFullscreen.lastPresentFence = SVGA_InsertFence();
+   fence = SVGA_InsertFence();
+   gFullscreen.presentFences[slot] = fence;
+   gFullscreen.lastPresentFence = fence;
+   gFullscreen.frame++;
+
+   if (gFullscreen.numColorBuffers > 1) {
+      gFullscreen.currentBuffer = (gFullscreen.currentBuffer + 1) %
+                                  gFullscreen.numColorBuffers;
+      gFullscreen.colorImage.sid = gFullscreen.colorSids[gFullscreen.currentBuffer];
+      SVGA3D_SetRenderTarget(gFullscreen.cid, SVGA3D_RT_COLOR0,
+                             &gFullscreen.colorImage);
+      SVGA_FIFOCommitAll();
+   }
+}
+
+
+/*
+ * Async call queue. Pending calls are kept in a singly linked list,
+ * oldest first. Entries come from a static pool, which grows from the
+ * heap if it ever runs dry, so enqueueing a call never has to wait
+ * for the host. Grown entries don't survive Heap_Reset, so apps that
+ * reset the heap must do it before their first async call.
+ */
+
+#define ASYNC_CALL_GROW  64
+
+typedef struct AsyncCallEntry {
+   struct AsyncCallEntry *next;
+   AsyncCallFn            handler;
+   void                  *arg;
+   uint32                 fence;
+   Bool                   early;    // May run from the bottom half
+} AsyncCallEntry;
+
+static struct {
+   AsyncCallEntry *head;        // Oldest pending call
+   AsyncCallEntry *tail;        // Newest pending call
+   AsyncCallEntry *freeList;
+   uint32          poolSize;
+   Bool            dispatching;
+   AsyncCallEntry  initialPool[MAX_ASYNC_CALLS];
+} gAsync;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilAsyncGrow --
+ *
+ *      Add entries to the async call free list: the static pool the
+ *      first time we're called, and chunks of heap memory after that.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May allocate memory which is never freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilAsyncGrow(void)
+{
+   AsyncCallEntry *entries;
+   uint32 count, i;
+
+   if (gAsync.poolSize) {
+      count = ASYNC_CALL_GROW;
+      entries = Heap_Alloc(count * sizeof *entries);
+   } else {
+      count = MAX_ASYNC_CALLS;
+      entries = gAsync.initialPool;
+   }
+
+   for (i = 0; i < count; i++) {
+      entries[i].next = gAsync.freeList;
+      gAsync.freeList = &entries[i];
+   }
+   gAsync.poolSize += count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilAsyncDispatch --
+ *
+ *      Run, in order, every pending async call whose fence has
+ *      passed. If 'all' is TRUE, run every pending call regardless of
+ *      its fence; the caller must know that the FIFO has been drained.
+ *      If 'earlyOnly' is TRUE, stop at the first call that wasn't
+ *      queued with SVGA3DUtil_AsyncCallEarly.
+ *
+ *      Rather than asking SVGA_HasFencePassed about each entry, we
+ *      read the host's fence once and compare every entry against it.
+ *      We only look again if we retired everything that had passed as
+ *      of our last look.
+ *
+ *      This also runs from our bottom half, in SVGA_WaitForIRQ after
+ *      each interrupt, possibly in the middle of a FIFO reservation.
+ *      Only handlers which promised not to touch the FIFO run from
+ *      there, and calls after the first ordinary one wait their turn.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Runs async call handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilAsyncDispatch(Bool all,        // IN
+                        Bool earlyOnly)  // IN
+{
+   Bool hasFences = SVGA_HasFIFOCap(SVGA_FIFO_CAP_FENCE);
+
+   if (gAsync.dispatching) {
+      return;
+   }
+   gAsync.dispatching = TRUE;
+
+   while (gAsync.head) {
+      uint32 current = hasFences ? gSVGA.fifoMem[SVGA_FIFO_FENCE] : 0;
+      Bool progress = FALSE;
+
+      while (gAsync.head) {
+         AsyncCallEntry *call = gAsync.head;
+
+         if (!all && !(hasFences && (int32)(current - call->fence) >= 0)) {
+            break;
+         }
+         if (earlyOnly && !call->early) {
+            break;
+         }
+
+         gAsync.head = call->next;
+         if (!gAsync.head) {
+            gAsync.tail = NULL;
+         }
+
+         call->handler(call->arg);
+
+         call->next = gAsync.freeList;
+         gAsync.freeList = call;
+         progress = TRUE;
+      }
+
+      if (!progress) {
+         break;
+      }
+   }
+
+   gAsync.dispatching = FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilAsyncBottomHalf --
+ *
+ *      Bottom half for the async call queue. See SVGA_SetBottomHalf().
+ *      Only runs calls from SVGA3DUtil_AsyncCallEarly.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Runs async call handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilAsyncBottomHalf(void)
+{
+   SVGA3DUtilAsyncDispatch(FALSE, TRUE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilAsyncEnqueue --
+ *
+ *      Queue a call to 'handler' once the host reaches the current
+ *      point in the FIFO.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Inserts a FIFO fence.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilAsyncEnqueue(AsyncCallFn handler,  // IN
+                       void *arg,            // IN
+                       Bool early)           // IN
+{
+   AsyncCallEntry *call;
+
+   if (!gAsync.poolSize) {
+      SVGA_SetBottomHalf(SVGA3DUtilAsyncBottomHalf);
+   }
+   if (!gAsync.freeList) {
+      SVGA3DUtilAsyncGrow();
+   }
+
+   call = gAsync.freeList;
+   gAsync.freeList = call->next;
+
+   call->handler = handler;
+   call->arg = arg;
+   call->early = early;
+   call->next = NULL;
+
+   /*
+    * Inserting the fence may wait for FIFO space and run the bottom
+    * half, so only link the call into the queue once it's complete.
+    */
+   call->fence = SVGA_InsertFence();
+
+   if (gAsync.tail) {
+      gAsync.tail->next = call;
+   } else {
+      gAsync.head = call;
+   }
+   gAsync.tail = call;
 }
 
 
@@ -186,11 +477,14 @@ SVGA3DUtil_PresentFullscreen(void)
  *      host VRAM.
  *
  *      This single function both dispatches previous calls and
- *      optionall enqueues a new call.
+ *      optionally enqueues a new call.
+ *
+ *      Handlers only run from here and from SVGA3DUtil_AsyncWait, so
+ *      they're free to use the FIFO. See SVGA3DUtil_AsyncCallEarly
+ *      for handlers that can run sooner.
  *
- *      A fixed number of asynchronous calls may be in flight at any
- *      given time. If MAX_ASYNC_CALLS calls are pending, we wait for
- *      the oldest one to finish.
+ *      There's no limit on the number of calls in flight. The queue
+ *      grows as needed, so we never wait for the host here.
  *
  *      You can call this function with handler==NULL to just flush
  *      any existing async calls which have completed.
@@ -199,9 +493,8 @@ SVGA3DUtil_PresentFullscreen(void)
  *      None.
  *
  * Side effects:
- *      SVGA_SyncToFence(), any side-effects caused by other async
- *      call handlers. If we're enqueueing a handler, this inserts
- *      a FIFO fence.
+ *      Any side-effects caused by other async call handlers. If we're
+ *      enqueueing a handler, this inserts a FIFO fence.
  *
  *----------------------------------------------------------------------
  */
@@ -210,38 +503,81 @@ void
 SVGA3DUtil_AsyncCall(AsyncCallFn handler,  // IN (optional)
                      void *arg)            // IN (optional)
 {
-   static struct {
-      uint32 head, tail, count;
-      struct {
-         AsyncCallFn  handler;
-         void        *arg;
-         uint32       fence;
-      } calls[MAX_ASYNC_CALLS];
-   } queue;
+   SVGA3DUtilAsyncDispatch(FALSE, FALSE);
 
-   if (queue.count > MAX_ASYNC_CALLS ||
-       queue.head >= MAX_ASYNC_CALLS ||
-       queue.tail >= MAX_ASYNC_CALLS) {
-      SVGA_Panic("Async call queue corrupted");
+   if (handler) {
+      SVGA3DUtilAsyncEnqueue(handler, arg, FALSE);
    }
+}
 
-   if (queue.count == MAX_ASYNC_CALLS) {
-      SVGA_SyncToFence(queue.calls[queue.tail].fence);
-   }
 
-   while (queue.count && SVGA_HasFencePassed(queue.calls[queue.tail].fence)) {
-      queue.calls[queue.tail].handler(queue.calls[queue.tail].arg);
-      queue.tail = (queue.tail + 1) % MAX_ASYNC_CALLS;
-      queue.count--;
-   }
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_AsyncCallEarly --
+ *
+ *      Like SVGA3DUtil_AsyncCall, but the handler may also run as soon
+ *      as the driver wakes up from an SVGA interrupt, for example
+ *      while waiting in SVGA_SyncToFence or for FIFO space.
+ *
+ *      That can happen in the middle of a FIFO reservation, so the
+ *      handler must not write to the FIFO, insert fences, or wait for
+ *      the device. Freeing memory and similar bookkeeping is fine.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See SVGA3DUtil_AsyncCall.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   if (handler) {
-      queue.calls[queue.head].handler = handler;
-      queue.calls[queue.head].arg = arg;
-      queue.calls[queue.head].fence = SVGA_InsertFence();
-      queue.head = (queue.head + 1) % MAX_ASYNC_CALLS;
-      queue.count++;
+void
+SVGA3DUtil_AsyncCallEarly(AsyncCallFn handler,  // IN
+                          void *arg)            // IN
+{
+   SVGA3DUtilAsyncDispatch(FALSE, FALSE);
+   SVGA3DUtilAsyncEnqueue(handler, arg, TRUE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_AsyncWait --
+ *
+ *      Wait for the oldest pending async call to complete, and
+ *      dispatch it along with any others that have completed.
+ *
+ *      This is the cheapest way to wait for a resource that's
+ *      released by an async call, like a DMA pool buffer: we wait for
+ *      only as much of the FIFO as necessary.
+ *
+ * Results:
+ *      FALSE if there were no pending async calls.
+ *
+ * Side effects:
+ *      May SVGA_SyncToFence(). Runs async call handlers.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+SVGA3DUtil_AsyncWait(void)
+{
+   if (!gAsync.head) {
+      return FALSE;
    }
+
+   SVGA_SyncToFence(gAsync.head->fence);
+
+   /*
+    * Without fence support, SyncToFence drained the whole FIFO, but
+    * we can't tell from the fences. Everything has completed.
+    */
+   SVGA3DUtilAsyncDispatch(!SVGA_HasFIFOCap(SVGA_FIFO_CAP_FENCE), FALSE);
+   return TRUE;
 }
 
 
@@ -305,32 +641,749 @@ SVGA3DUtil_UpdateFPSCounter(FPSCounterState *self)  // IN/OUT
 
    VMBackdoor_GetTime(&self->now);
 
-   msecDiff = VMBackdoor_TimeDiffUS(&self->lastUpdate.time, &self->now) / 1000;
+   msecDiff = VMBackdoor_TimeDiffUS(&self->lastUpdate.time, &self->now) / 1000;
+
+   if (msecDiff < 500) {
+      /* Too soon since the last update */
+      return FALSE;
+   }
+
+   frameDiff = self->frame - self->lastUpdate.frame;
+   self->hundredths = (frameDiff * (1000 * 100)) / msecDiff;
+
+   self->text[0] = FPSDigit(self->hundredths, 1000000);
+   self->text[1] = FPSDigit(self->hundredths, 100000);
+   self->text[2] = FPSDigit(self->hundredths, 10000);
+   self->text[3] = FPSDigit(self->hundredths, 1000);
+   self->text[4] = FPSDigit(self->hundredths, 100);
+   self->text[5] = '.';
+   self->text[6] = FPSDigit(self->hundredths, 10);
+   self->text[7] = FPSDigit(self->hundredths, 1);
+   self->text[8] = ' ';
+   self->text[9] = 'F';
+   self->text[10] = 'P';
+   self->text[11] = 'S';
+   self->text[12] = '\0';
+
+   self->lastUpdate.time = self->now;
+   self->lastUpdate.frame = self->frame;
+   return TRUE;
+}
+
+
+/*
+ * Surface ID allocator.
+ *
+ * The bitmap has a bit set for each sid that is either in use or
+ * destroyed but waiting on its fence. Deferred destroys are kept in
+ * a ring, in fence order.
+ */
+
+#define SURFACE_ID_WORDS  (SVGA3D_MAX_SURFACE_IDS / 32)
+#define DESTROY_BATCH     256
+
+typedef struct DeferredDestroy {
+   uint32 sid;
+   uint32 fence;
+} DeferredDestroy;
+
+static struct {
+   uint32          bitmap[SURFACE_ID_WORDS];
+   uint32          hint;        // Word to start searching from
+   DeferredDestroy pending[MAX_DEFERRED_DESTROYS];
+   uint32          pendingHead;
+   uint32          pendingCount;
+   SVGAMemCounter  ids;
+} gSurfaceIds;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilFreeSurfaceID --
+ *
+ *      Free a surface ID right away. Only for IDs that were never
+ *      defined as surfaces, so the host can't be using them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilFreeSurfaceID(uint32 sid)  // IN
+{
+   gSurfaceIds.bitmap[sid / 32] &= ~(1 << (sid % 32));
+   gSurfaceIds.hint = MIN(gSurfaceIds.hint, sid / 32);
+   SVGA_CountFree(&gSurfaceIds.ids, 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilReclaimSurfaceIDs --
+ *
+ *      Free the IDs of deferred destroys whose fences have passed. If
+ *      'wait' is TRUE and none have, wait for the oldest one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May Sync.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SVGA3DUtilReclaimSurfaceIDs(Bool wait)  // IN
+{
+   while (gSurfaceIds.pendingCount) {
+      DeferredDestroy *oldest = &gSurfaceIds.pending[(gSurfaceIds.pendingHead +
+                                                      MAX_DEFERRED_DESTROYS -
+                                                      gSurfaceIds.pendingCount) %
+                                                     MAX_DEFERRED_DESTROYS];
+      if (!SVGA_HasFencePassed(oldest->fence)) {
+         if (!wait) {
+            break;
+         }
+         SVGA_SyncToFence(oldest->fence);
+      }
+      wait = FALSE;
+
+      SVGA3DUtilFreeSurfaceID(oldest->sid);
+      gSurfaceIds.pendingCount--;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_AllocSurfaceID --
+ *
+ *      Allocate the lowest available surface ID. IDs are recycled
+ *      once surfaces destroyed with SVGA3DUtil_DestroySurfaceDeferred
+ *      have finished being destroyed.
+ *
+ * Results:
+ *      Returns an unused sid.
+ *
+ * Side effects:
+ *      Marks this sid as used. May Sync, if every ID is in use or
+ *      waiting on a fence.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+SVGA3DUtil_AllocSurfaceID(void)
+{
+   SVGA3DUtilReclaimSurfaceIDs(FALSE);
+
+   for (;;) {
+      uint32 word;
+
+      for (word = gSurfaceIds.hint; word < SURFACE_ID_WORDS; word++) {
+         uint32 bits = gSurfaceIds.bitmap[word];
+
+         if (bits != 0xFFFFFFFF) {
+            uint32 bit = 0;
+
+            while (bits & (1 << bit)) {
+               bit++;
+            }
+            gSurfaceIds.bitmap[word] |= 1 << bit;
+            gSurfaceIds.hint = word;
+            SVGA_CountAlloc(&gSurfaceIds.ids, 1);
+            return word * 32 + bit;
+         }
+      }
+      gSurfaceIds.hint = SURFACE_ID_WORDS;
+
+      if (!gSurfaceIds.pendingCount) {
+         SVGA_Panic("Out of surface IDs");
+      }
+      SVGA3DUtilReclaimSurfaceIDs(TRUE);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_GetSurfaceIDStats --
+ *
+ *      Report surface ID usage. An ID counts as in use from
+ *      SVGA3DUtil_AllocSurfaceID until its deferred destroy has
+ *      finished; 'pending' is how many are waiting on a fence.
+ *      Surfaces destroyed without SVGA3DUtil_DestroySurfaceDeferred
+ *      never free their IDs.
+ *
+ * Results:
+ *      Fills in 'ids' and 'pending'.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_GetSurfaceIDStats(SVGAMemCounter *ids,  // OUT
+                             uint32 *pending)      // OUT
+{
+   *ids = gSurfaceIds.ids;
+   *pending = gSurfaceIds.pendingCount;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DestroySurfacesDeferred --
+ *
+ *      Destroy a list of surfaces, and recycle their IDs once the
+ *      host has processed the destroys. Commands already in the FIFO
+ *      may still refer to these surfaces; the IDs won't be handed out
+ *      again until those are finished.
+ *
+ *      The destroy commands are batched into as few FIFO reservations
+ *      as possible, followed by a single fence.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO. May Sync, if too many destroys are
+ *      pending.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_DestroySurfacesDeferred(const uint32 *sids,  // IN
+                                   uint32 count)        // IN
+{
+   uint32 fence, i;
+
+   for (i = 0; i < count; i += DESTROY_BATCH) {
+      uint32 batch = MIN(count - i, DESTROY_BATCH);
+      uint32 cmdSize = sizeof(SVGA3dCmdHeader) + sizeof(SVGA3dCmdDestroySurface);
+      uint8 *cmds = SVGA_FIFOReserve(batch * cmdSize);
+      uint32 j;
+
+      for (j = 0; j < batch; j++) {
+         SVGA3dCmdHeader *header = (SVGA3dCmdHeader*) (cmds + j * cmdSize);
+         SVGA3dCmdDestroySurface *cmd = (SVGA3dCmdDestroySurface*) &header[1];
+
+         header->id = SVGA_3D_CMD_SURFACE_DESTROY;
+         header->size = sizeof *cmd;
+         cmd->sid = sids[i + j];
+      }
+      SVGA_FIFOCommitAll();
+   }
+
+   fence = SVGA_InsertFence();
+
+   for (i = 0; i < count; i++) {
+      DeferredDestroy *entry;
+
+      if (gSurfaceIds.pendingCount == MAX_DEFERRED_DESTROYS) {
+         SVGA3DUtilReclaimSurfaceIDs(TRUE);
+      }
+
+      entry = &gSurfaceIds.pending[gSurfaceIds.pendingHead];
+      entry->sid = sids[i];
+      entry->fence = fence;
+
+      gSurfaceIds.pendingHead = (gSurfaceIds.pendingHead + 1) % MAX_DEFERRED_DESTROYS;
+      gSurfaceIds.pendingCount++;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DestroySurfaceDeferred --
+ *
+ *      Destroy one surface, and recycle its ID once the host has
+ *      processed the destroy.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_DestroySurfaceDeferred(uint32 sid)  // IN
+{
+   SVGA3DUtil_DestroySurfacesDeferred(&sid, 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_AllocDMABuffer --
+ *
+ *      Allocate a buffer for DMA operations. Returns both a pointer
+ *      (for us to use) and an SVGAGuestPtr (for the SVGA3D device to
+ *      use).
+ *
+ *      If the app has called GMR_Init, the buffer gets its own GMR,
+ *      backed by contiguous pages from our heap. That keeps staging
+ *      memory out of VRAM, where it would compete with the
+ *      framebuffer, and lets it grow with guest RAM. If we're out of
+ *      GMR IDs or heap pages, or GMRs aren't initialized, the buffer
+ *      comes from the framebuffer GMR like any other VRAM allocation.
+ *
+ *      GMR-backed buffers are freed with GMR_ReleaseNow, so apps using
+ *      them mustn't call GMR_FreeAll or Heap_Reset.
+ *
+ * Results:
+ *      Returns a local pointer and an SVGAGuestPtr to unused memory.
+ *
+ * Side effects:
+ *      Allocates memory. May define a GMR.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+SVGA3DUtil_AllocDMABuffer(uint32 size,        // IN
+                          SVGAGuestPtr *ptr)  // OUT
+{
+   uint32 gmrId;
+
+   if (gGMR.maxDescriptorLen && GMR_TryAllocId(&gmrId)) {
+      PPN firstPage = GMR_TryDefineContiguous(gmrId, (size + PAGE_MASK) / PAGE_SIZE);
+
+      if (firstPage) {
+         ptr->gmrId = gmrId;
+         ptr->offset = 0;
+         return PPN_POINTER(firstPage);
+      }
+      GMR_ReleaseNow(gmrId);
+   }
+
+   return SVGA_AllocGMR(size, ptr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_FreeDMABuffer --
+ *
+ *      Free a buffer from SVGA3DUtil_AllocDMABuffer. The caller must
+ *      make sure that no DMA operations using it are still queued.
+ *
+ *      This never touches the FIFO, so it's a suitable handler for
+ *      SVGA3DUtil_AsyncCallEarly. A GMR-backed buffer's ID and pages
+ *      are reclaimed later, by the GMR allocator.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees memory, or releases the buffer's GMR.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_FreeDMABuffer(SVGAGuestPtr *ptr)  // IN
+{
+   if (ptr->gmrId == SVGA_GMR_FRAMEBUFFER) {
+      SVGA_FreeGMR(ptr);
+   } else {
+      GMR_ReleaseNow(ptr->gmrId);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DefineSurface2D --
+ *
+ *      This is a simplified version of SVGA3D_BeginDefineSurface(),
+ *      which does not support cube maps, mipmaps, or volume textures.
+ *
+ * Results:
+ *      Returns the new surface ID.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+SVGA3DUtil_DefineSurface2D(uint32 width,                // IN
+                           uint32 height,               // IN
+                           SVGA3dSurfaceFormat format)  // IN
+{
+   uint32 sid;
+   SVGA3dSize *mipSizes;
+   SVGA3dSurfaceFace *faces;
+
+   sid = SVGA3DUtil_AllocSurfaceID();
+   SVGA3D_BeginDefineSurface(sid, 0, format, &faces, &mipSizes, 1);
+
+   faces[0].numMipLevels = 1;
+
+   mipSizes[0].width = width;
+   mipSizes[0].height = height;
+   mipSizes[0].depth = 1;
+
+   SVGA_FIFOCommitAll();
+
+   return sid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DefineSurface2DFlags --
+ *
+ *      This is a simplified version of SVGA3D_BeginDefineSurface(),
+ *      which does not support cube maps, mipmaps, or volume textures,
+ *      but which does allow the caller to specify whether this is an
+ *      index or vertex buffer, and whether it is static or dynamic.
+ *
+ * Results:
+ *      Returns the new surface ID.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+uint32
+SVGA3DUtil_DefineSurface2DFlags(uint32 width,                // IN
+                                uint32 height,               // IN
+                                SVGA3dSurfaceFormat format,  // IN
+                                uint32 flags)                // IN
+{
+   uint32 sid;
+   SVGA3dSize *mipSizes;
+   SVGA3dSurfaceFace *faces;
+
+   sid = SVGA3DUtil_AllocSurfaceID();
+   SVGA3D_BeginDefineSurface(sid, flags, format, &faces, &mipSizes, 1);
+
+   faces[0].numMipLevels = 1;
+
+   mipSizes[0].width = width;
+   mipSizes[0].height = height;
+   mipSizes[0].depth = 1;
+
+   SVGA_FIFOCommitAll();
+
+   return sid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_SurfaceSize2D --
+ *
+ *      Estimate how many bytes of host memory a single-level 2D
+ *      surface takes, for bookkeeping. Formats we don't know about
+ *      are assumed to be 32 bits per pixel.
+ *
+ * Results:
+ *      Returns a size in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+SVGA3DUtil_SurfaceSize2D(uint32 width,                // IN
+                         uint32 height,               // IN
+                         SVGA3dSurfaceFormat format)  // IN
+{
+   uint32 blocks = ((width + 3) / 4) * ((height + 3) / 4);
+
+   switch (format) {
+
+   case SVGA3D_DXT1:
+   case SVGA3D_BC4_UNORM:
+      return blocks * 8;
+
+   case SVGA3D_DXT2:
+   case SVGA3D_DXT3:
+   case SVGA3D_DXT4:
+   case SVGA3D_DXT5:
+   case SVGA3D_BC5_UNORM:
+      return blocks * 16;
+
+   case SVGA3D_NV12:
+      return width * height * 3 / 2;
+
+   case SVGA3D_BUFFER:
+   case SVGA3D_LUMINANCE8:
+   case SVGA3D_LUMINANCE4_ALPHA4:
+   case SVGA3D_ALPHA8:
+      return width * height;
+
+   case SVGA3D_R5G6B5:
+   case SVGA3D_X1R5G5B5:
+   case SVGA3D_A1R5G5B5:
+   case SVGA3D_A4R4G4B4:
+   case SVGA3D_Z_D16:
+   case SVGA3D_Z_D15S1:
+   case SVGA3D_Z_DF16:
+   case SVGA3D_LUMINANCE16:
+   case SVGA3D_LUMINANCE8_ALPHA8:
+   case SVGA3D_BUMPU8V8:
+   case SVGA3D_BUMPL6V5U5:
+   case SVGA3D_V8U8:
+   case SVGA3D_CxV8U8:
+   case SVGA3D_R_S10E5:
+   case SVGA3D_UYVY:
+   case SVGA3D_YUY2:
+      return width * height * 2;
+
+   case SVGA3D_ARGB_S10E5:
+   case SVGA3D_RG_S23E8:
+   case SVGA3D_A16B16G16R16:
+      return width * height * 8;
+
+   case SVGA3D_ARGB_S23E8:
+      return width * height * 16;
+
+   default:
+      return width * height * 4;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_SurfaceSize --
+ *
+ *      Estimate the host memory used by a surface with every face and
+ *      mip level, given the same 'faces' and 'mipSizes' arrays as
+ *      SVGA3D_BeginDefineSurface.
+ *
+ * Results:
+ *      Returns a size in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+SVGA3DUtil_SurfaceSize(SVGA3dSurfaceFormat format,      // IN
+                       const SVGA3dSurfaceFace *faces,  // IN
+                       const SVGA3dSize *mipSizes)      // IN
+{
+   uint32 bytes = 0;
+   int face, level;
+
+   for (face = 0; face < SVGA3D_MAX_SURFACE_FACES; face++) {
+      for (level = 0; level < faces[face].numMipLevels; level++) {
+         bytes += SVGA3DUtil_SurfaceSize2D(mipSizes->width, mipSizes->height,
+                                           format) * mipSizes->depth;
+         mipSizes++;
+      }
+   }
+
+   return bytes;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_SurfaceDMA2D --
+ *
+ *      This is a simplified version of SVGA3D_BeginSurfaceDMA(),
+ *      which copies a single 2D rectangle rooted at 0,0. It does
+ *      not support volume textures, mipmaps, cube maps, or guest
+ *      images with non-default pitch. See SVGA3DUtil_SurfaceDMARect
+ *      and SVGA3DUtil_SurfaceDMABox for those.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Begins an asynchronous DMA operation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_SurfaceDMA2D(uint32 sid,                   // IN
+                        SVGAGuestPtr *guestPtr,       // IN
+                        SVGA3dTransferType transfer,  // IN
+                        uint32 width,                 // IN
+                        uint32 height)                // IN
+{
+   SVGA3dCopyBox *boxes;
+   SVGA3dGuestImage guestImage;
+   SVGA3dSurfaceImageId hostImage = { sid };
+
+   guestImage.ptr = *guestPtr;
+   guestImage.pitch = 0;
+
+   SVGA3D_BeginSurfaceDMA(&guestImage, &hostImage, transfer, &boxes, 1);
+   boxes[0].w = width;
+   boxes[0].h = height;
+   boxes[0].d = 1;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_SurfaceDMABox --
+ *
+ *      DMA one box between a surface image and a guest image which
+ *      may be larger than the box. The box's x, y and z are in the
+ *      surface; srcx, srcy and srcz locate the same region in guest
+ *      memory, whose rows are 'guestPitch' bytes apart. A dirty
+ *      region can then be copied straight out of a larger image,
+ *      such as a texture atlas or a framebuffer-sized staging
+ *      buffer, without repacking it.
+ *
+ *      A pitch of zero means tightly packed rows. Compressed formats
+ *      must be tightly packed, so they can only use a pitch of zero.
+ *      To copy many boxes between the same two images, use
+ *      SVGA3DUtil_DMABatchAdd instead.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Begins an asynchronous DMA operation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_SurfaceDMABox(const SVGA3dSurfaceImageId *hostImage,  // IN
+                         const SVGAGuestPtr *guestPtr,           // IN
+                         uint32 guestPitch,                      // IN
+                         const SVGA3dCopyBox *box,               // IN
+                         SVGA3dTransferType transfer)            // IN
+{
+   SVGA3dCopyBox *boxes;
+   SVGA3dGuestImage guestImage;
+   SVGA3dSurfaceImageId host = *hostImage;
+
+   guestImage.ptr = *guestPtr;
+   guestImage.pitch = guestPitch;
+
+   SVGA3D_BeginSurfaceDMA(&guestImage, &host, transfer, &boxes, 1);
+   boxes[0] = *box;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_SurfaceDMARect --
+ *
+ *      The 2D version of SVGA3DUtil_SurfaceDMABox: DMA the rectangle
+ *      'rect' between mip level 0 of a 2D surface and a guest image
+ *      with rows 'guestPitch' bytes apart. The rectangle's x and y
+ *      are in the surface, srcx and srcy are in the guest image.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Begins an asynchronous DMA operation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_SurfaceDMARect(uint32 sid,                   // IN
+                          const SVGAGuestPtr *guestPtr, // IN
+                          uint32 guestPitch,            // IN
+                          const SVGA3dCopyRect *rect,   // IN
+                          SVGA3dTransferType transfer)  // IN
+{
+   SVGA3dSurfaceImageId hostImage = { sid };
+   SVGA3dCopyBox box = {
+      .x = rect->x,
+      .y = rect->y,
+      .w = rect->w,
+      .h = rect->h,
+      .d = 1,
+      .srcx = rect->srcx,
+      .srcy = rect->srcy,
+   };
+
+   SVGA3DUtil_SurfaceDMABox(&hostImage, guestPtr, guestPitch, &box, transfer);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilMergeSpan --
+ *
+ *      Merge the span [pos2, pos2+size2) into [*pos, *pos+*size) along
+ *      one axis, if they touch or overlap. The source position moves
+ *      along with the destination position.
+ *
+ *      We use 64-bit ends, since boxes may be as large as the device
+ *      allows and rely on the host to clip them.
+ *
+ * Results:
+ *      TRUE if the spans were merged.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+SVGA3DUtilMergeSpan(uint32 *pos,     // IN/OUT
+                    uint32 *size,    // IN/OUT
+                    uint32 *srcPos,  // IN/OUT
+                    uint32 pos2,     // IN
+                    uint32 size2)    // IN
+{
+   uint64 end1 = (uint64)*pos + *size;
+   uint64 end2 = (uint64)pos2 + size2;
+   uint32 start;
 
-   if (msecDiff < 500) {
-      /* Too soon since the last update */
+   if (pos2 > end1 || *pos > end2) {
       return FALSE;
    }
 
-   frameDiff = self->frame - self->lastUpdate.frame;
-   self->hundredths = (frameDiff * (1000 * 100)) / msecDiff;
-
-   self->text[0] = FPSDigit(self->hundredths, 1000000);
-   self->text[1] = FPSDigit(self->hundredths, 100000);
-   self->text[2] = FPSDigit(self->hundredths, 10000);
-   self->text[3] = FPSDigit(self->hundredths, 1000);
-   self->text[4] = FPSDigit(self->hundredths, 100);
-   self->text[5] = '.';
-   self->text[6] = FPSDigit(self->hundredths, 10);
-   self->text[7] = FPSDigit(self->hundredths, 1);
-   self->text[8] = ' ';
-   self->text[9] = 'F';
-   self->text[10] = 'P';
-   self->text[11] = 'S';
-   self->text[12] = '\0';
-
-   self->lastUpdate.time = self->now;
-   self->lastUpdate.frame = self->frame;
+   start = MIN(*pos, pos2);
+   *srcPos -= *pos - start;
+   *pos = start;
+   *size = MIN(MAX(end1, end2) - start, 0xFFFFFFFF);
    return TRUE;
 }
 
@@ -338,66 +1391,92 @@ SVGA3DUtil_UpdateFPSCounter(FPSCounterState *self)  // IN/OUT
 /*
  *----------------------------------------------------------------------
  *
- * SVGA3DUtil_AllocSurfaceID --
- *
- *      Allocate the next available surface ID.
+ * SVGA3DUtilBoxContains --
  *
- *      XXX: This is a trivial implementation which just returns
- *           an incrementing integer.
+ *      Is box 'b' entirely inside box 'a'?
  *
  * Results:
- *      Returns an unused sid.
+ *      TRUE if it is.
  *
  * Side effects:
- *      Marks this sid as used.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-uint32
-SVGA3DUtil_AllocSurfaceID(void)
+static Bool
+SVGA3DUtilBoxContains(const SVGA3dCopyBox *a,  // IN
+                      const SVGA3dCopyBox *b)  // IN
 {
-   static uint32 nextSid = 0;
-   return nextSid++;
+   return b->x >= a->x && (uint64)b->x + b->w <= (uint64)a->x + a->w &&
+          b->y >= a->y && (uint64)b->y + b->h <= (uint64)a->y + a->h &&
+          b->z >= a->z && (uint64)b->z + b->d <= (uint64)a->z + a->d;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * SVGA3DUtil_AllocDMABuffer --
+ * SVGA3DUtilMergeBoxes --
  *
- *      Allocate a buffer for DMA operations. Returns both a pointer
- *      (for us to use) and an SVGAGuestPtr (for the SVGA3D device to
- *      use).
+ *      Try to replace box 'a' with a single box covering both 'a' and
+ *      'b'. That's possible when both boxes copy with the same offset
+ *      between source and destination, and either one contains the
+ *      other or they line up on two axes and touch on the third.
  *
  * Results:
- *      Returns a local pointer and an SVGAGuestPtr to unused memory.
+ *      TRUE if 'a' now covers 'b' too.
  *
  * Side effects:
- *      Allocates memory.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-void *
-SVGA3DUtil_AllocDMABuffer(uint32 size,        // IN
-                          SVGAGuestPtr *ptr)  // OUT
+static Bool
+SVGA3DUtilMergeBoxes(SVGA3dCopyBox *a,        // IN/OUT
+                     const SVGA3dCopyBox *b)  // IN
 {
-   return SVGA_AllocGMR(size, ptr);
+   Bool sameX = a->x == b->x && a->w == b->w;
+   Bool sameY = a->y == b->y && a->h == b->h;
+   Bool sameZ = a->z == b->z && a->d == b->d;
+
+   if (a->srcx - a->x != b->srcx - b->x ||
+       a->srcy - a->y != b->srcy - b->y ||
+       a->srcz - a->z != b->srcz - b->z) {
+      return FALSE;
+   }
+
+   if (SVGA3DUtilBoxContains(a, b)) {
+      return TRUE;
+   }
+   if (SVGA3DUtilBoxContains(b, a)) {
+      *a = *b;
+      return TRUE;
+   }
+
+   if (sameY && sameZ) {
+      return SVGA3DUtilMergeSpan(&a->x, &a->w, &a->srcx, b->x, b->w);
+   }
+   if (sameX && sameZ) {
+      return SVGA3DUtilMergeSpan(&a->y, &a->h, &a->srcy, b->y, b->h);
+   }
+   if (sameX && sameY) {
+      return SVGA3DUtilMergeSpan(&a->z, &a->d, &a->srcz, b->z, b->d);
+   }
+   return FALSE;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * SVGA3DUtil_DefineSurface2D --
+ * SVGA3DUtilSpansOverlap --
  *
- *      This is a simplified version of SVGA3D_BeginDefineSurface(),
- *      which does not support cube maps, mipmaps, or volume textures.
+ *      Do spans [pos1, pos1+size1) and [pos2, pos2+size2) overlap?
  *
  * Results:
- *      Returns the new surface ID.
+ *      TRUE if they do.
  *
  * Side effects:
  *      None.
@@ -405,111 +1484,208 @@ SVGA3DUtil_AllocDMABuffer(uint32 size,        // IN
  *----------------------------------------------------------------------
  */
 
-uint32
-SVGA3DUtil_DefineSurface2D(uint32 width,                // IN
-                           uint32 height,               // IN
-                           SVGA3dSurfaceFormat format)  // IN
+static Bool
+SVGA3DUtilSpansOverlap(uint32 pos1,   // IN
+                       uint32 size1,  // IN
+                       uint32 pos2,   // IN
+                       uint32 size2)  // IN
 {
-   uint32 sid;
-   SVGA3dSize *mipSizes;
-   SVGA3dSurfaceFace *faces;
-
-   sid = SVGA3DUtil_AllocSurfaceID();
-   SVGA3D_BeginDefineSurface(sid, 0, format, &faces, &mipSizes, 1);
+   return pos2 < (uint64)pos1 + size1 && pos1 < (uint64)pos2 + size2;
+}
 
-   faces[0].numMipLevels = 1;
 
-   mipSizes[0].width = width;
-   mipSizes[0].height = height;
-   mipSizes[0].depth = 1;
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtilBoxesConflict --
+ *
+ *      Would reordering boxes 'a' and 'b' change the result of a DMA?
+ *      That's the case when they copy with different offsets and
+ *      overlap on either the host or the guest side. We don't know
+ *      the transfer direction here, so we check both.
+ *
+ * Results:
+ *      TRUE if the boxes must stay in order.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   SVGA_FIFOCommitAll();
+static Bool
+SVGA3DUtilBoxesConflict(const SVGA3dCopyBox *a,  // IN
+                        const SVGA3dCopyBox *b)  // IN
+{
+   if (a->srcx - a->x == b->srcx - b->x &&
+       a->srcy - a->y == b->srcy - b->y &&
+       a->srcz - a->z == b->srcz - b->z) {
+      return FALSE;
+   }
 
-   return sid;
+   return (SVGA3DUtilSpansOverlap(a->x, a->w, b->x, b->w) &&
+           SVGA3DUtilSpansOverlap(a->y, a->h, b->y, b->h) &&
+           SVGA3DUtilSpansOverlap(a->z, a->d, b->z, b->d)) ||
+          (SVGA3DUtilSpansOverlap(a->srcx, a->w, b->srcx, b->w) &&
+           SVGA3DUtilSpansOverlap(a->srcy, a->h, b->srcy, b->h) &&
+           SVGA3DUtilSpansOverlap(a->srcz, a->d, b->srcz, b->d));
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * SVGA3DUtil_DefineSurface2DFlags --
+ * SVGA3DUtil_CoalesceBoxes --
  *
- *      This is a simplified version of SVGA3D_BeginDefineSurface(),
- *      which does not support cube maps, mipmaps, or volume textures,
- *      but which does allow the caller to specify whether this is an
- *      index or vertex buffer, and whether it is static or dynamic.
+ *      Optimize a list of copy boxes for one SURFACE_DMA, in place:
+ *      drop empty boxes, and merge boxes which are adjacent or
+ *      overlapping into larger ones. The boxes must all have the same
+ *      guest and host images. Overlapping boxes with the same
+ *      source-to-destination offset copy the same data, so merging
+ *      them doesn't change the result.
+ *
+ *      The host applies boxes in order, and merging a box into an
+ *      earlier one moves its copy ahead of the boxes in between. So
+ *      we only merge when none of those conflict with it, and the
+ *      remaining boxes keep their original order.
  *
  * Results:
- *      Returns the new surface ID.
+ *      Returns the new number of boxes.
  *
  * Side effects:
  *      None.
  *
  *----------------------------------------------------------------------
  */
+
 uint32
-SVGA3DUtil_DefineSurface2DFlags(uint32 width,                // IN
-                                uint32 height,               // IN
-                                SVGA3dSurfaceFormat format,  // IN
-                                uint32 flags)                // IN
+SVGA3DUtil_CoalesceBoxes(SVGA3dCopyBox *boxes,  // IN/OUT
+                         uint32 numBoxes)       // IN
 {
-   uint32 sid;
-   SVGA3dSize *mipSizes;
-   SVGA3dSurfaceFace *faces;
+   uint32 i, j, count = 0;
+   Bool merged;
 
-   sid = SVGA3DUtil_AllocSurfaceID();
-   SVGA3D_BeginDefineSurface(sid, flags, format, &faces, &mipSizes, 1);
+   for (i = 0; i < numBoxes; i++) {
+      if (boxes[i].w && boxes[i].h && boxes[i].d) {
+         boxes[count++] = boxes[i];
+      }
+   }
 
-   faces[0].numMipLevels = 1;
+   do {
+      merged = FALSE;
+      for (i = 0; i < count; i++) {
+         j = i + 1;
+         while (j < count) {
+            uint32 k;
+
+            for (k = i + 1; k < j; k++) {
+               if (SVGA3DUtilBoxesConflict(&boxes[k], &boxes[j])) {
+                  break;
+               }
+            }
+
+            if (k == j && SVGA3DUtilMergeBoxes(&boxes[i], &boxes[j])) {
+               count--;
+               for (k = j; k < count; k++) {
+                  boxes[k] = boxes[k + 1];
+               }
+               merged = TRUE;
+            } else {
+               j++;
+            }
+         }
+      }
+   } while (merged);
+
+   return count;
+}
 
-   mipSizes[0].width = width;
-   mipSizes[0].height = height;
-   mipSizes[0].depth = 1;
 
-   SVGA_FIFOCommitAll();
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DMABatchAdd --
+ *
+ *      Queue one copy box for a SURFACE_DMA. Consecutive boxes with
+ *      the same guest image, host image, and transfer direction are
+ *      sent as a single command, with their boxes coalesced. Anything
+ *      else flushes the batch first.
+ *
+ *      Nothing is written to the FIFO until the batch is flushed, so
+ *      call SVGA3DUtil_DMABatchFlush before any command which depends
+ *      on these transfers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May flush the batch.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   return sid;
+void
+SVGA3DUtil_DMABatchAdd(SurfaceDMABatch *self,               // IN/OUT
+                       const SVGA3dGuestImage *guest,       // IN
+                       const SVGA3dSurfaceImageId *host,    // IN
+                       SVGA3dTransferType transfer,         // IN
+                       const SVGA3dCopyBox *box)            // IN
+{
+   if (self->numBoxes &&
+       (self->guest.ptr.gmrId != guest->ptr.gmrId ||
+        self->guest.ptr.offset != guest->ptr.offset ||
+        self->guest.pitch != guest->pitch ||
+        self->host.sid != host->sid ||
+        self->host.face != host->face ||
+        self->host.mipmap != host->mipmap ||
+        self->transfer != transfer)) {
+      SVGA3DUtil_DMABatchFlush(self);
+   }
+
+   if (self->numBoxes == DMA_BATCH_MAX_BOXES) {
+      self->numBoxes = SVGA3DUtil_CoalesceBoxes(self->boxes, self->numBoxes);
+      if (self->numBoxes == DMA_BATCH_MAX_BOXES) {
+         SVGA3DUtil_DMABatchFlush(self);
+      }
+   }
+
+   self->guest = *guest;
+   self->host = *host;
+   self->transfer = transfer;
+   self->boxes[self->numBoxes++] = *box;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * SVGA3DUtil_SurfaceDMA2D --
+ * SVGA3DUtil_DMABatchFlush --
  *
- *      This is a simplified version of SVGA3D_BeginSurfaceDMA(),
- *      which copies a single 2D rectangle rooted at 0,0. It does
- *      not support volume textures, mipmaps, cube maps, or guest
- *      images with non-default pitch.
+ *      Send any queued boxes as one SURFACE_DMA command.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      Begins an asynchronous DMA operation.
+ *      May begin an asynchronous DMA operation.
  *
  *----------------------------------------------------------------------
  */
 
 void
-SVGA3DUtil_SurfaceDMA2D(uint32 sid,                   // IN
-                        SVGAGuestPtr *guestPtr,       // IN
-                        SVGA3dTransferType transfer,  // IN
-                        uint32 width,                 // IN
-                        uint32 height)                // IN
+SVGA3DUtil_DMABatchFlush(SurfaceDMABatch *self)  // IN/OUT
 {
    SVGA3dCopyBox *boxes;
-   SVGA3dGuestImage guestImage;
-   SVGA3dSurfaceImageId hostImage = { sid };
+   uint32 numBoxes = SVGA3DUtil_CoalesceBoxes(self->boxes, self->numBoxes);
 
-   guestImage.ptr = *guestPtr;
-   guestImage.pitch = 0;
+   if (numBoxes) {
+      SVGA3D_BeginSurfaceDMA(&self->guest, &self->host, self->transfer,
+                             &boxes, numBoxes);
+      memcpy(boxes, self->boxes, numBoxes * sizeof *boxes);
+      SVGA_FIFOCommitAll();
+   }
 
-   SVGA3D_BeginSurfaceDMA(&guestImage, &hostImage, transfer, &boxes, 1);
-   boxes[0].w = width;
-   boxes[0].h = height;
-   boxes[0].d = 1;
-   SVGA_FIFOCommitAll();
+   self->numBoxes = 0;
 }
 
 
@@ -551,6 +1727,147 @@ SVGA3DUtil_DefineStaticBuffer(const void *data,  // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_InitStaticArena --
+ *
+ *      Set up a static-geometry arena with room for 'size' bytes.
+ *      Instead of defining a surface and uploading it for every
+ *      small vertex or index buffer, add them all to an arena and
+ *      upload it once. Draws then refer to each buffer by the
+ *      arena's sid and the buffer's offset.
+ *
+ *      The arena's sid is allocated now, but the surface isn't
+ *      defined until SVGA3DUtil_StaticArenaUpload, when we know how
+ *      much of it is used.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates a surface ID and a DMA buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_InitStaticArena(StaticArena *self,  // OUT
+                           uint32 size)        // IN
+{
+   memset(self, 0, sizeof *self);
+
+   self->sid = SVGA3DUtil_AllocSurfaceID();
+   self->size = size;
+   self->buffer = SVGA3DUtil_AllocDMABuffer(size, &self->ptr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_StaticArenaAdd --
+ *
+ *      Copy a static buffer into the arena, at an offset which is a
+ *      multiple of 'alignment'. Index buffers must be aligned to
+ *      their index size.
+ *
+ * Results:
+ *      Returns the arena's sid and the buffer's offset within it,
+ *      for use in SVGA3dArrayIdentity and SVGA3dPrimitiveRange.
+ *
+ * Side effects:
+ *      Panics if the arena is full or already uploaded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+StaticArenaBuffer
+SVGA3DUtil_StaticArenaAdd(StaticArena *self,   // IN/OUT
+                          const void *data,    // IN
+                          uint32 size,         // IN
+                          uint32 alignment)    // IN
+{
+   StaticArenaBuffer result;
+   uint32 offset;
+
+   if (self->uploaded) {
+      SVGA_Panic("Static arena already uploaded");
+   }
+
+   alignment = MAX(alignment, 1);
+   offset = (self->used + alignment - 1) / alignment * alignment;
+
+   if (offset + size > self->size) {
+      SVGA_Panic("Static arena full");
+   }
+
+   memcpy(self->buffer + offset, data, size);
+   self->used = offset + size;
+
+   result.sid = self->sid;
+   result.offset = offset;
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_StaticArenaUpload --
+ *
+ *      Define the arena's surface, just large enough for everything
+ *      we added, and upload all of it with one DMA. The DMA buffer is
+ *      freed once the transfer completes.
+ *
+ *      An empty arena has nothing to upload. We free its surface ID
+ *      and DMA buffer instead, and its sid becomes SVGA3D_INVALID_ID.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Defines a surface.
+ *      Begins an asynchronous DMA operation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_StaticArenaUpload(StaticArena *self)  // IN/OUT
+{
+   SVGA3dSize *mipSizes;
+   SVGA3dSurfaceFace *faces;
+
+   if (self->uploaded) {
+      return;
+   }
+
+   if (!self->used) {
+      SVGA3DUtilFreeSurfaceID(self->sid);
+      SVGA3DUtil_FreeDMABuffer(&self->ptr);
+      self->sid = SVGA3D_INVALID_ID;
+      self->buffer = NULL;
+      self->uploaded = TRUE;
+      return;
+   }
+
+   SVGA3D_BeginDefineSurface(self->sid, 0, SVGA3D_BUFFER, &faces, &mipSizes, 1);
+   faces[0].numMipLevels = 1;
+   mipSizes[0].width = self->used;
+   mipSizes[0].height = 1;
+   mipSizes[0].depth = 1;
+   SVGA_FIFOCommitAll();
+
+   SVGA3DUtil_SurfaceDMA2D(self->sid, &self->ptr, SVGA3D_WRITE_HOST_VRAM,
+                           self->used, 1);
+   SVGA3DUtil_AsyncCallEarly((AsyncCallFn) SVGA3DUtil_FreeDMABuffer, &self->ptr);
+
+   self->buffer = NULL;
+   self->uploaded = TRUE;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -685,9 +2002,13 @@ SVGA3DUtil_AllocDMAPool(DMAPool *self,      // OUT
  *      Retrieve an available buffer from a DMAPool. This
  *      returns the first available buffer from our freelist.
  *
- *      If no buffers are on the freelist, we use Sync and
- *      AsyncCall to give them a chance to become available.
+ *      Buffers given back with SVGA3DUtil_DMAPoolReleaseBuffer move
+ *      to the freelist once their fences have passed. If nothing is
+ *      free, we wait for the oldest released buffer's fence, rather
+ *      than for the whole FIFO.
  *
+ *      If nothing has been released, we wait for pending async calls
+ *      to complete, one at a time, until one of them frees a buffer.
  *      If that fails, there must have been a buffer leak. We panic.
  *
  * Results:
@@ -704,11 +2025,23 @@ SVGA3DUtil_DMAPoolGetBuffer(DMAPool *self)  // IN/OUT
 {
    DMAPoolBuffer *buffer;
 
-   if (!self->freeList) {
-      SVGA_SyncToFence(SVGA_InsertFence());
-      SVGA3DUtil_AsyncCall(NULL, NULL);
+   while (self->pendingHead) {
+      buffer = self->pendingHead;
+
+      if (!SVGA_HasFencePassed(buffer->fence)) {
+         if (self->freeList) {
+            break;
+         }
+         self->numWaits++;
+         SVGA_SyncToFence(buffer->fence);
+      }
+
+      self->pendingHead = buffer->next;
+      SVGA3DUtil_DMAPoolFreeBuffer(buffer);
    }
 
+   while (!self->freeList && SVGA3DUtil_AsyncWait());
+
    buffer = self->freeList;
    if (!buffer) {
       SVGA_Panic("No DMA buffers available from pool");
@@ -745,6 +2078,45 @@ SVGA3DUtil_DMAPoolFreeBuffer(DMAPoolBuffer *buffer)  // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3DUtil_DMAPoolReleaseBuffer --
+ *
+ *      Give a DMAPool buffer back as soon as it's submitted. 'fence'
+ *      must come after the last command which uses the buffer; the
+ *      pool won't hand the buffer out again until it has passed.
+ *
+ *      Buffers are reclaimed in release order, so release them in
+ *      the order their fences were inserted.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3DUtil_DMAPoolReleaseBuffer(DMAPoolBuffer *buffer,  // IN
+                                uint32 fence)           // IN
+{
+   DMAPool *self = buffer->pool;
+
+   buffer->fence = fence;
+   buffer->next = NULL;
+
+   if (self->pendingHead) {
+      self->pendingTail->next = buffer;
+   } else {
+      self->pendingHead = buffer;
+   }
+   self->pendingTail = buffer;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -45,8 +45,9 @@
 
 #define CID                  1
 
-#define MAX_ASYNC_CALLS      128
+#define MAX_ASYNC_CALLS      128   // Initial size; the queue grows as needed
 #define MAX_DMA_POOL_BUFFERS 128
+#define MAX_DEFERRED_DESTROYS 1024
 
 typedef struct DMAPool DMAPool;
 
@@ -55,15 +56,54 @@ typedef struct DMAPoolBuffer {
    struct DMAPoolBuffer *next;
    void *buffer;
    SVGAGuestPtr ptr;
+   uint32 fence;                  // Last use, while on the pending list
 } DMAPoolBuffer;
 
 struct DMAPool {
    uint32 bufferSize;
    uint32 numBuffers;
    DMAPoolBuffer *freeList;
+   DMAPoolBuffer *pendingHead;    // Released buffers, in release order
+   DMAPoolBuffer *pendingTail;
+   uint32 numWaits;               // GetBuffer calls which had to wait
    DMAPoolBuffer buffers[MAX_DMA_POOL_BUFFERS];
 };
 
+/*
+ * A static-geometry arena: many small static buffers sharing one
+ * SVGA3D_BUFFER surface, uploaded with a single DMA.
+ */
+
+typedef struct StaticArenaBuffer {
+   uint32 sid;
+   uint32 offset;
+} StaticArenaBuffer;
+
+typedef struct StaticArena {
+   uint32 sid;
+   uint32 size;
+   uint32 used;
+   uint8 *buffer;
+   SVGAGuestPtr ptr;
+   Bool uploaded;
+} StaticArena;
+
+/*
+ * Batches consecutive SURFACE_DMA boxes with the same guest image,
+ * host image, and direction into one command. Zero-initialize it
+ * before use.
+ */
+
+#define DMA_BATCH_MAX_BOXES  64
+
+typedef struct SurfaceDMABatch {
+   SVGA3dGuestImage      guest;
+   SVGA3dSurfaceImageId  host;
+   SVGA3dTransferType    transfer;
+   uint32                numBoxes;
+   SVGA3dCopyBox         boxes[DMA_BATCH_MAX_BOXES];
+} SurfaceDMABatch;
+
 typedef struct FPSCounterState {
    VMTime  now;
    uint32  frame;
@@ -80,15 +120,31 @@ typedef struct FPSCounterState {
 
 /*
  * Global data used by the "Fullscreen" utility functions.  These
- * utilities make extra assumptions: We're rendering from a single
- * color buffer, and we're using the SVGA device's full resolution.
+ * utilities make extra assumptions: We're rendering to one of a small
+ * ring of color buffers, and we're using the SVGA device's full
+ * resolution.
+ *
+ * colorImage is always the buffer currently bound as the render
+ * target. Up to 'framesInFlight' presents may be queued in the FIFO
+ * at once. If there are multiple color buffers, they're rotated
+ * round-robin after each present.
  */
 
+#define FULLSCREEN_MAX_FRAMES  4
+
 typedef struct FullscreenState {
    SVGA3dSurfaceImageId colorImage;
    SVGA3dSurfaceImageId depthImage;
    uint32 lastPresentFence;
    SVGA3dRect screen;
+
+   uint32 cid;
+   uint32 framesInFlight;
+   uint32 numColorBuffers;
+   uint32 currentBuffer;
+   uint32 frame;                                   // Number of presents so far
+   uint32 colorSids[FULLSCREEN_MAX_FRAMES];
+   uint32 presentFences[FULLSCREEN_MAX_FRAMES];    // Ring of presents in flight
 } FullscreenState;
 
 extern FullscreenState gFullscreen;
@@ -101,8 +157,12 @@ typedef void (*AsyncCallFn)(void *);
  */
 
 void SVGA3DUtil_InitFullscreen(uint32 cid, uint32 width, uint32 height);
+void SVGA3DUtil_InitFullscreenBuffered(uint32 cid, uint32 width, uint32 height,
+                                       uint32 framesInFlight, uint32 numColorBuffers);
 void SVGA3DUtil_PresentFullscreen(void);
 void SVGA3DUtil_AsyncCall(AsyncCallFn handler, void *arg);
+void SVGA3DUtil_AsyncCallEarly(AsyncCallFn handler, void *arg);
+Bool SVGA3DUtil_AsyncWait(void);
 Bool SVGA3DUtil_UpdateFPSCounter(FPSCounterState *self);
 
 /*
@@ -110,22 +170,47 @@ Bool SVGA3DUtil_UpdateFPSCounter(FPSCounterState *self);
  */
 
 uint32 SVGA3DUtil_AllocSurfaceID(void);
+void SVGA3DUtil_DestroySurfaceDeferred(uint32 sid);
+void SVGA3DUtil_DestroySurfacesDeferred(const uint32 *sids, uint32 count);
+void SVGA3DUtil_GetSurfaceIDStats(SVGAMemCounter *ids, uint32 *pending);
 void *SVGA3DUtil_AllocDMABuffer(uint32 size, SVGAGuestPtr *ptr);
+void SVGA3DUtil_FreeDMABuffer(SVGAGuestPtr *ptr);
 
 uint32 SVGA3DUtil_DefineSurface2D(uint32 width, uint32 height,
                                   SVGA3dSurfaceFormat format);
-uint32 SVGA3DUtil_DefineSurface2DFlags(uint32 width, uint32 height, uint32 flags,
-                                       SVGA3dSurfaceFormat format);
+uint32 SVGA3DUtil_DefineSurface2DFlags(uint32 width, uint32 height,
+                                       SVGA3dSurfaceFormat format, uint32 flags);
+uint32 SVGA3DUtil_SurfaceSize2D(uint32 width, uint32 height,
+                                SVGA3dSurfaceFormat format);
+uint32 SVGA3DUtil_SurfaceSize(SVGA3dSurfaceFormat format,
+                              const SVGA3dSurfaceFace *faces,
+                              const SVGA3dSize *mipSizes);
 void SVGA3DUtil_SurfaceDMA2D(uint32 sid, SVGAGuestPtr *guestPtr,
                              SVGA3dTransferType transfer, uint32 width, uint32 height);
+void SVGA3DUtil_SurfaceDMARect(uint32 sid, const SVGAGuestPtr *guestPtr,
+                               uint32 guestPitch, const SVGA3dCopyRect *rect,
+                               SVGA3dTransferType transfer);
+void SVGA3DUtil_SurfaceDMABox(const SVGA3dSurfaceImageId *hostImage,
+                              const SVGAGuestPtr *guestPtr, uint32 guestPitch,
+                              const SVGA3dCopyBox *box, SVGA3dTransferType transfer);
+uint32 SVGA3DUtil_CoalesceBoxes(SVGA3dCopyBox *boxes, uint32 numBoxes);
+void SVGA3DUtil_DMABatchAdd(SurfaceDMABatch *self, const SVGA3dGuestImage *guest,
+                            const SVGA3dSurfaceImageId *host,
+                            SVGA3dTransferType transfer, const SVGA3dCopyBox *box);
+void SVGA3DUtil_DMABatchFlush(SurfaceDMABatch *self);
 
 uint32 SVGA3DUtil_DefineStaticBuffer(const void *data, uint32 size);
+void SVGA3DUtil_InitStaticArena(StaticArena *self, uint32 size);
+StaticArenaBuffer SVGA3DUtil_StaticArenaAdd(StaticArena *self, const void *data,
+                                            uint32 size, uint32 alignment);
+void SVGA3DUtil_StaticArenaUpload(StaticArena *self);
 uint32 SVGA3DUtil_LoadCompressedBuffer(const DataFile *file, uint32 flags,
                                        uint32 *pSize);
 
 void SVGA3DUtil_AllocDMAPool(DMAPool *self, uint32 bufferSize, uint32 numBuffers);
 DMAPoolBuffer *SVGA3DUtil_DMAPoolGetBuffer(DMAPool *self);
 void SVGA3DUtil_DMAPoolFreeBuffer(DMAPoolBuffer *buffer);
+void SVGA3DUtil_DMAPoolReleaseBuffer(DMAPoolBuffer *buffer, uint32 fence);
 
 /*
  * Shaders
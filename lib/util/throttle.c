@@ -0,0 +1,286 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * throttle.c --
+ *
+ *      Latency-targeted flow control for FIFO producers. See
+ *      throttle.h for an overview.
+ */
+
+#include "throttle.h"
+#include "timer.h"
+#include "vmbackdoor.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThrottleRetire --
+ *
+ *      Retire all marks whose fences have passed, and fold the
+ *      observed drain rate into our estimate.
+ *
+ *      The host worked on the retired bytes from the time we noticed
+ *      the previous retirement (or the time it went idle) until now.
+ *      We only notice a retirement when we look for it, so this is an
+ *      upper bound on how long the host took. That errs on the side
+ *      of throttling a bit too much, never too little. When we just
+ *      woke up from SVGA_SyncToFence, the interval is accurate.
+ *
+ *      If 'syncedFence' is nonzero, we just synchronized to it and
+ *      the oldest mark with that fence is retired unconditionally.
+ *      This matters on hosts without FIFO fences, where
+ *      SVGA_HasFencePassed can't tell us anything.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the throttle's estimate.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ThrottleRetire(Throttle *t,         // IN/OUT
+               uint32 syncedFence)  // IN
+{
+   ThrottleMark *mark = NULL;
+   uint64 now;
+   uint32 bytes;
+
+   while (t->count) {
+      ThrottleMark *oldest = &t->marks[(t->head + THROTTLE_MAX_MARKS - t->count)
+                                       % THROTTLE_MAX_MARKS];
+      if (oldest->fence == syncedFence) {
+         syncedFence = 0;
+      } else if (!SVGA_HasFencePassed(oldest->fence)) {
+         break;
+      }
+
+      mark = oldest;
+      t->count--;
+   }
+
+   if (!mark) {
+      return;
+   }
+
+   now = Timer_GetTSC();
+   bytes = mark->bytes - t->retiredBytes;
+
+   if (bytes && now > t->retiredTSC) {
+      float sample = (int64)(now - t->retiredTSC) / (float)bytes;
+
+      if (t->cyclesPerByte == 0.0f) {
+         t->cyclesPerByte = sample;
+      } else {
+         t->cyclesPerByte += (sample - t->cyclesPerByte) * 0.125f;
+      }
+   }
+
+   t->retiredBytes = mark->bytes;
+   t->retiredTSC = now;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThrottleOverBudget --
+ *
+ *      Is there more work in flight than our limits allow?
+ *
+ * Results:
+ *      TRUE if the producer should wait.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+ThrottleOverBudget(Throttle *t)  // IN
+{
+   uint32 inFlight = gSVGA.fifo.bytesCommitted - t->retiredBytes;
+
+   if (t->count >= t->maxMarks) {
+      return TRUE;
+   }
+   if (t->maxBytes && inFlight > t->maxBytes) {
+      return TRUE;
+   }
+   return inFlight * t->cyclesPerByte > (int64)t->budgetCycles;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Throttle_Init --
+ *
+ *      Set up a throttle which keeps roughly 'budgetUS' microseconds
+ *      of host work in flight. If 'maxBytes' is nonzero, it's also a
+ *      hard cap on the number of FIFO bytes in flight.
+ *
+ *      Until the throttle has seen a few marks retire, it has no
+ *      drain rate estimate, and it only limits the number of marks
+ *      in flight.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Asks the host for the TSC frequency.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Throttle_Init(Throttle *t,      // OUT
+              uint32 budgetUS,  // IN
+              uint32 maxBytes)  // IN
+{
+   memset(t, 0, sizeof *t);
+
+   t->mhz = VMBackdoor_GetMHz();
+   if (!t->mhz) {
+      t->mhz = 1;
+   }
+
+   t->budgetCycles = (uint64)budgetUS * t->mhz;
+   t->maxBytes = maxBytes;
+   t->maxMarks = THROTTLE_MAX_MARKS;
+   t->retiredBytes = gSVGA.fifo.bytesCommitted;
+   t->retiredTSC = Timer_GetTSC();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Throttle_Mark --
+ *
+ *      Insert a fence that marks the end of a unit of work, such as
+ *      a frame or a batch of draws. Marks should be frequent enough
+ *      that several fit within the latency budget; the throttle can
+ *      only wait at mark granularity.
+ *
+ * Results:
+ *      Returns the inserted fence.
+ *
+ * Side effects:
+ *      May block, if the mark ring is full.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+Throttle_Mark(Throttle *t)  // IN/OUT
+{
+   ThrottleMark *mark;
+
+   if (t->count == THROTTLE_MAX_MARKS) {
+      Throttle_Wait(t);
+   }
+
+   mark = &t->marks[t->head];
+   mark->fence = SVGA_InsertFence();
+   mark->bytes = gSVGA.fifo.bytesCommitted;
+
+   t->head = (t->head + 1) % THROTTLE_MAX_MARKS;
+   t->count++;
+
+   return mark->fence;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Throttle_Wait --
+ *
+ *      Call before producing more work. If the estimated time for
+ *      the host to drain everything in flight exceeds our budget,
+ *      block on the oldest outstanding marks until it doesn't.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May block.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+Throttle_Wait(Throttle *t)  // IN/OUT
+{
+   ThrottleRetire(t, 0);
+
+   /*
+    * If nothing is in flight, the host is idle. Start timing the
+    * next batch of work from now, so the idle time isn't mistaken
+    * for a slow host.
+    */
+   if (!t->count) {
+      t->retiredTSC = Timer_GetTSC();
+   }
+
+   while (t->count && ThrottleOverBudget(t)) {
+      ThrottleMark *oldest = &t->marks[(t->head + THROTTLE_MAX_MARKS - t->count)
+                                       % THROTTLE_MAX_MARKS];
+      SVGA_SyncToFence(oldest->fence);
+      t->stalls++;
+      ThrottleRetire(t, oldest->fence);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Throttle_EstimateUS --
+ *
+ *      Estimate how long it will take the host to finish all the work
+ *      currently in flight, for diagnostic display.
+ *
+ * Results:
+ *      Microseconds, or 0 if we don't have an estimate yet.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+Throttle_EstimateUS(Throttle *t)  // IN
+{
+   uint32 inFlight = gSVGA.fifo.bytesCommitted - t->retiredBytes;
+   return inFlight * t->cyclesPerByte / t->mhz;
+}
@@ -0,0 +1,79 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * throttle.h --
+ *
+ *      Latency-targeted flow control for FIFO producers.
+ *
+ *      Without flow control, a producer keeps writing until the FIFO
+ *      is full. With a large FIFO, that can be a lot of queued work,
+ *      and everything we submit afterwards waits behind it. A Throttle
+ *      instead caps the work in flight at a latency budget: the
+ *      producer periodically drops a mark (a fence tagged with a
+ *      timestamp and the FIFO byte count), and before producing more
+ *      work it waits until the host's estimated time to drain the
+ *      queue is under budget.
+ *
+ *      The host's drain rate is estimated from how quickly marks
+ *      retire, so the throttle adapts to both cheap and expensive
+ *      commands.
+ */
+
+#ifndef __THROTTLE_H__
+#define __THROTTLE_H__
+
+#include "svga.h"
+
+#define THROTTLE_MAX_MARKS  64
+
+typedef struct ThrottleMark {
+   uint32  fence;
+   uint32  bytes;    // gSVGA.fifo.bytesCommitted when the mark was made
+} ThrottleMark;
+
+typedef struct Throttle {
+   uint64        budgetCycles;   // Target latency, in TSC cycles
+   uint32        maxBytes;       // Optional hard cap on bytes in flight
+   uint32        maxMarks;       // Cap on marks in flight
+   uint32        mhz;
+
+   float         cyclesPerByte;  // Estimated host drain rate, 0 if unknown
+   uint32        retiredBytes;   // Byte count at the last retired mark
+   uint64        retiredTSC;     // When we noticed the last retirement
+
+   ThrottleMark  marks[THROTTLE_MAX_MARKS];
+   uint32        head;
+   uint32        count;
+
+   uint32        stalls;         // Number of times Throttle_Wait blocked
+} Throttle;
+
+void Throttle_Init(Throttle *t, uint32 budgetUS, uint32 maxBytes);
+uint32 Throttle_Mark(Throttle *t);
+void Throttle_Wait(Throttle *t);
+uint32 Throttle_EstimateUS(Throttle *t);
+
+#endif /* __THROTTLE_H__ */
@@ -0,0 +1,281 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * uploadring.c --
+ *
+ *      Streaming upload heap. See uploadring.h for an overview.
+ */
+
+#include "uploadring.h"
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRingRetire --
+ *
+ *      Free the space behind every mark whose fence has passed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UploadRingRetire(UploadRing *ring)  // IN/OUT
+{
+   while (ring->markCount) {
+      UploadRingMark *oldest = &ring->marks[(ring->markHead + UPLOAD_RING_MAX_MARKS -
+                                             ring->markCount) % UPLOAD_RING_MAX_MARKS];
+      if (!SVGA_HasFencePassed(oldest->fence)) {
+         break;
+      }
+
+      ring->used -= oldest->bytes;
+      ring->markCount--;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRingWaitOldest --
+ *
+ *      Block until the oldest mark retires.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Syncs to a fence.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+UploadRingWaitOldest(UploadRing *ring)  // IN/OUT
+{
+   UploadRingMark *oldest = &ring->marks[(ring->markHead + UPLOAD_RING_MAX_MARKS -
+                                          ring->markCount) % UPLOAD_RING_MAX_MARKS];
+   SVGA_SyncToFence(oldest->fence);
+
+   ring->used -= oldest->bytes;
+   ring->markCount--;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRing_Init --
+ *
+ *      Allocate a 'size' byte DMA buffer to use as an upload ring.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Allocates DMA memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+UploadRing_Init(UploadRing *ring,  // OUT
+                uint32 size)       // IN
+{
+   memset(ring, 0, sizeof *ring);
+
+   ring->size = size & ~(UPLOAD_RING_ALIGN - 1);
+   ring->buffer = SVGA3DUtil_AllocDMABuffer(ring->size, &ring->ptr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRing_Alloc --
+ *
+ *      Allocate 'size' bytes of the ring for an upload. The space is
+ *      contiguous, and stays valid until a mark made after this
+ *      allocation has retired. Call UploadRing_Mark after submitting
+ *      the commands which read it.
+ *
+ *      If the ring is full, we wait for the oldest mark. If nothing
+ *      is marked, the ring is full of allocations whose commands may
+ *      not have been submitted yet, so we can't safely wait for them.
+ *
+ * Results:
+ *      Returns a pointer to the allocation, and its guest pointer in
+ *      'ptr'.
+ *
+ * Side effects:
+ *      May block. Panics if the ring is full and nothing is marked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+UploadRing_Alloc(UploadRing *ring,   // IN/OUT
+                 uint32 size,        // IN
+                 SVGAGuestPtr *ptr)  // OUT
+{
+   uint32 needed, offset;
+   Bool wrap;
+
+   size = (size + UPLOAD_RING_ALIGN - 1) & ~(UPLOAD_RING_ALIGN - 1);
+   if (size > ring->size) {
+      SVGA_Panic("UploadRing: Allocation larger than the ring.");
+   }
+
+   for (;;) {
+      UploadRingRetire(ring);
+
+      if (!ring->used) {
+         ring->head = 0;
+      }
+
+      /*
+       * If we don't fit before the end of the ring, the rest of it
+       * is wasted until the next mark retires.
+       */
+      wrap = ring->head + size > ring->size;
+      needed = size;
+      if (wrap) {
+         needed += ring->size - ring->head;
+      }
+
+      if (needed <= ring->size - ring->used) {
+         break;
+      }
+
+      if (!ring->markCount) {
+         SVGA_Panic("UploadRing: Ring is full of unmarked allocations.");
+      }
+      ring->stalls++;
+      UploadRingWaitOldest(ring);
+   }
+
+   offset = wrap ? 0 : ring->head;
+   ring->head = offset + size;
+   ring->used += needed;
+   ring->unmarked += needed;
+
+   ptr->gmrId = ring->ptr.gmrId;
+   ptr->offset = ring->ptr.offset + offset;
+
+   return ring->buffer + offset;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRing_Mark --
+ *
+ *      Insert a fence after everything which uses the space allocated
+ *      since the last mark. That space is reused once the fence has
+ *      passed.
+ *
+ * Results:
+ *      Returns the inserted fence.
+ *
+ * Side effects:
+ *      May block, if there are too many marks outstanding.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32
+UploadRing_Mark(UploadRing *ring)  // IN/OUT
+{
+   UploadRingMark *mark;
+
+   if (ring->markCount == UPLOAD_RING_MAX_MARKS) {
+      UploadRingWaitOldest(ring);
+   }
+
+   mark = &ring->marks[ring->markHead];
+   mark->fence = SVGA_InsertFence();
+   mark->bytes = ring->unmarked;
+   ring->unmarked = 0;
+
+   ring->markHead = (ring->markHead + 1) % UPLOAD_RING_MAX_MARKS;
+   ring->markCount++;
+
+   return mark->fence;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * UploadRing_SurfaceDMA --
+ *
+ *      Upload 'size' bytes from 'ptr' to byte 'offset' of a buffer
+ *      surface. 'flags' is a combination of UPLOAD_DISCARD and
+ *      UPLOAD_NOOVERWRITE, passed to the host in the DMA suffix.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+UploadRing_SurfaceDMA(const SVGAGuestPtr *ptr,  // IN
+                      uint32 sid,               // IN
+                      uint32 offset,            // IN
+                      uint32 size,              // IN
+                      uint32 flags)             // IN
+{
+   SVGA3dGuestImage guestImage = { *ptr, 0 };
+   SVGA3dSurfaceImageId hostImage = { sid };
+   SVGA3dCmdSurfaceDMASuffix *suffix;
+   SVGA3dCopyBox *boxes;
+
+   SVGA3D_BeginSurfaceDMAWithSuffix(&guestImage, &hostImage, SVGA3D_WRITE_HOST_VRAM,
+                                    &boxes, 1, &suffix);
+
+   boxes[0].x = offset;
+   boxes[0].w = size;
+   boxes[0].h = 1;
+   boxes[0].d = 1;
+
+   suffix->maximumOffset = size;
+   suffix->flags.discard = (flags & UPLOAD_DISCARD) != 0;
+   suffix->flags.unsynchronized = (flags & UPLOAD_NOOVERWRITE) != 0;
+
+   SVGA_FIFOCommitAll();
+}
@@ -0,0 +1,91 @@
+/**********************************************************
+ * Copyright 2008-2010 VMware, Inc.  All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ **********************************************************/
+
+/*
+ * uploadring.h --
+ *
+ *      Streaming upload heap, for data which changes every frame.
+ *
+ *      An UploadRing is one large DMA buffer, used as a ring. Each
+ *      upload gets a fresh piece of it, so we never have to wait for
+ *      the host to finish with a buffer before refilling it. After
+ *      submitting a batch of uploads, the app drops a mark (a fence);
+ *      the space allocated before a mark is reused once its fence has
+ *      passed. We only block when the ring is full.
+ *
+ *      Uploads can also tell the host how they relate to pending work
+ *      on the destination surface, like D3D's lock flags:
+ *
+ *        UPLOAD_DISCARD      The old contents of the surface are
+ *                            dead. The host may rename the surface
+ *                            rather than wait for pending draws.
+ *
+ *        UPLOAD_NOOVERWRITE  This upload doesn't overwrite anything
+ *                            pending draws still use, so the host
+ *                            needn't synchronize with them.
+ *
+ *      A typical dynamic vertex buffer is filled with one DISCARD
+ *      upload per frame followed by NOOVERWRITE appends.
+ */
+
+#ifndef __UPLOADRING_H__
+#define __UPLOADRING_H__
+
+#include "svga3dutil.h"
+
+#define UPLOAD_RING_MAX_MARKS  64
+#define UPLOAD_RING_ALIGN      16
+
+#define UPLOAD_DISCARD         (1 << 0)
+#define UPLOAD_NOOVERWRITE     (1 << 1)
+
+typedef struct UploadRingMark {
+   uint32  fence;
+   uint32  bytes;            // Bytes allocated since the previous mark
+} UploadRingMark;
+
+typedef struct UploadRing {
+   uint8          *buffer;
+   SVGAGuestPtr    ptr;
+   uint32          size;
+
+   uint32          head;          // Offset of the next allocation
+   uint32          used;          // Bytes which may still be in use
+   uint32          unmarked;      // Bytes allocated since the last mark
+
+   UploadRingMark  marks[UPLOAD_RING_MAX_MARKS];
+   uint32          markHead;
+   uint32          markCount;
+
+   uint32          stalls;        // Allocations which had to wait
+} UploadRing;
+
+void UploadRing_Init(UploadRing *ring, uint32 size);
+void *UploadRing_Alloc(UploadRing *ring, uint32 size, SVGAGuestPtr *ptr);
+uint32 UploadRing_Mark(UploadRing *ring);
+void UploadRing_SurfaceDMA(const SVGAGuestPtr *ptr, uint32 sid,
+                           uint32 offset, uint32 size, uint32 flags);
+
+#endif /* __UPLOADRING_H__ */
@@ -196,6 +196,37 @@ VMBackdoor_TimeDiffUS(VMTime *first,   // IN
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMBackdoor_GetMHz --
+ *
+ *      Ask the host for the speed of the processor's timestamp
+ *      counter. This is useful for converting Timer_GetTSC() deltas
+ *      into wall-clock time without making a backdoor call for every
+ *      sample.
+ *
+ * Results:
+ *      TSC frequency, in MHz.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+uint32
+VMBackdoor_GetMHz(void)
+{
+   BACKDOOR_VARS()
+
+   ecx = BDOOR_CMD_GETMHZ;
+   BACKDOOR_ASM_IN()
+
+   return eax;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
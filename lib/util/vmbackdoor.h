@@ -73,6 +73,7 @@ Bool VMBackdoor_MouseGetPacket(VMMousePacket *packet);
 
 void VMBackdoor_GetTime(VMTime *time);
 int32 VMBackdoor_TimeDiffUS(VMTime *first, VMTime *second);
+uint32 VMBackdoor_GetMHz(void);
 
 void VMBackdoor_MsgOpen(VMMessageChannel *channel, uint32 proto);
 void VMBackdoor_MsgClose(VMMessageChannel *channel);